@@ -7,125 +7,657 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include <ngx_md5.h>
 #include <ngx_conf_def.h>
 
 
 #define NGX_CONF_TYPE_TEXT   0
 #define NGX_CONF_TYPE_EXPR   1
 
+#define NGX_CONF_SCRIPT_ARENA_SIZE  16384
+
 
 /* TODO: mutualize with ngx_http_script for parsing / running the mix of
  * strings and variables. */
 
 typedef struct {
-    ngx_str_t        *value;
-    ngx_conf_t       *cf;
-    ngx_array_t       parts;
-    ngx_array_t       part_types;
+    ngx_uint_t        type;
+    ngx_str_t         val;
+} ngx_conf_ccv_part_t;
+
+typedef struct {
+    ngx_str_t              *value;
+    ngx_conf_t             *cf;
+    ngx_conf_script_ctx_t  *ctx;
+    ngx_conf_script_mark_t  mark;
+    ngx_conf_ccv_part_t    *parts;
+    ngx_uint_t              nparts;
+    ngx_uint_t              nalloc;
 } ngx_conf_ccv_t;
 
 #define T_END   '$'
 #define T_ALPHA 'A'
 #define T_NUM   '0'
-#define T_FUNC  'f'
-#define T_VAR   'v'
-/* Parenthesis for arithmetic priority, e.g. 3 * ( 1 + 2 ) */
-#define T_ARPAR 'p'
-/* Undetermined parenthesis, before knowing if for a function's parameters, or in arithmetic */
+/* A literal */
+#define T_CONST 'c'
+/* Parenthesis, either grouping or around a function's parameters */
 #define T_PAR '('
+/* Operators: + - * / % == != < <= > >= && || ! */
+#define T_OPER 'o'
+/* A '- or "-quoted string literal, made a T_CONST */
+#define T_QUOTE 'q'
 
 typedef struct {
     u_char type;
-    int n_ops;
     ngx_str_t text;
 } ngx_conf_ccv_token_t;
 
-int ngx_conf_ccv_compile(ngx_conf_ccv_t *ccv);
+/* Operations of compiled codes, in the interpreter's dispatch order */
+#define NGX_CONF_CCV_END    0
+/* A literal, or a pure function's or an operator's result folded at compile
+ * time */
+#define NGX_CONF_CCV_CONST  1
+#define NGX_CONF_CCV_VAR    2
+/* The current file's directory */
+#define NGX_CONF_CCV_DOT    3
+#define NGX_CONF_CCV_CALL   4
+#define NGX_CONF_CCV_OPER   5
+
+/* The interpreter jumps from code to code through a table of labels where
+ * the compiler has them as values, and loops on a switch elsewhere. */
+#if (defined __GNUC__ && !defined NGX_CONF_CCV_NO_THREADING)
+#define NGX_CONF_CCV_THREADED  1
+#else
+#define NGX_CONF_CCV_THREADED  0
+#endif
+
+/* Values the interpreter stacks without allocating */
+#define NGX_CONF_CCV_STACK  16
+
+/* The unit of a stacked value whose number, if any, is still to be read
+ * from its text */
+#define NGX_CONF_CCV_TEXT  ((ngx_uint_t) -1)
+
+/* A compiled expression's instruction: it pushes a value, once it popped the
+ * nargs values of a call or an operator. Names are bound at compile time:
+ * calls to their function, variables to their symbol. */
+typedef struct {
+    u_char op;
+    int nargs;
+    ngx_str_t text;
+    ngx_conf_script_func_t *func; /* CALL */
+    ngx_int_t sym; /* VAR */
+    ngx_conf_script_num_t num; /* CONST, read at compile time */
+} ngx_conf_ccv_code_t;
+
+/* An operator, parenthesis or call on the compiler's stack, waiting for its
+ * operands to be output. */
+typedef struct {
+    ngx_conf_ccv_token_t *token;
+    int prio; /* 0 for a parenthesis or a call */
+    int nargs; /* of a call so far; -1 for a parenthesis */
+} ngx_conf_ccv_pending_t;
+
+/* A level of a scope map: slot holds the children (the variables at the
+ * last level) whose bits are set in bitmap, in bit order. A node only
+ * changes in place for the scope that made it; other scopes copy the path
+ * to what they change. */
+struct ngx_conf_script_map_s {
+    ngx_conf_script_vars_t  *owner;
+    uint32_t                 bitmap;
+    void                    *slot[1];
+};
+
+#define NGX_CONF_SCRIPT_MAP_BITS  5
+
+/* An expression, compiled once per configuration load: its codes in postfix
+ * order, ended by an END one, whose texts point into the cache's own copy of
+ * the expression, and how many values they stack at most. */
+typedef struct {
+    ngx_conf_ccv_code_t *codes;
+    int n_codes;
+    int depth;
+} ngx_conf_ccv_prog_t;
+
+/* Profiling counters, either running totals, or attributed to a file or a
+ * directive when conf_scripts_stats is on. */
+typedef struct {
+    ngx_uint_t               calls;      /* ngx_conf_complex_value() */
+    ngx_uint_t               expanded;   /* ... on a value with scripts */
+    ngx_uint_t               exprs;      /* expressions resolved */
+    ngx_uint_t               lookups;    /* variables looked up */
+    ngx_uint_t               depth;      /* map levels descended by them */
+    ngx_uint_t               max_depth;
+    uint64_t                 usec;
+    size_t                   bytes;      /* scratch and results */
+} ngx_conf_script_stats_t;
+
+/* A configuration file being parsed. */
+typedef struct ngx_conf_script_file_s  ngx_conf_script_file_t;
+
+/* What an expansion read: a variable's value, or . */
+typedef struct {
+    ngx_str_t                name;
+    ngx_str_t                val;
+} ngx_conf_script_dep_t;
+
+/* An expansion kept for the next configuration load, valid as long as its
+ * dependencies have the same values there. */
+typedef struct ngx_conf_script_stored_s  ngx_conf_script_stored_t;
+
+struct ngx_conf_script_stored_s {
+    ngx_conf_script_stored_t *next;      /* same text, other dependencies */
+    ngx_str_t                result;
+    ngx_uint_t               ndeps;
+    ngx_conf_script_dep_t   *deps;
+};
+
+#define NGX_CONF_SCRIPT_STORED_MAX  4    /* variants of a same text */
+
+typedef struct {
+    ngx_file_info_t          info;
+    ngx_conf_script_hash_t   values;     /* by marks and text */
+} ngx_conf_script_stored_file_t;
+
+struct ngx_conf_script_store_s {
+    ngx_conf_script_hash_t   files;      /* by name */
+};
+
+
+#define NGX_CONF_SCRIPT_SNAPSHOT_MAGIC     "ngxcsnap"
+#define NGX_CONF_SCRIPT_SNAPSHOT_VERSION   1
+
+typedef struct {
+    u_char                   magic[8];
+    uint32_t                 version;
+    uint32_t                 order;      /* 0x01020304, as written */
+    uint64_t                 size;       /* of the whole snapshot */
+    uint32_t                 nrecs;
+    uint32_t                 reserved;
+    u_char                   param[16];  /* MD5 of -g directives */
+} ngx_conf_script_snapshot_header_t;
+
+#define NGX_CONF_SCRIPT_SNAPSHOT_FILE      1
+#define NGX_CONF_SCRIPT_SNAPSHOT_VALUE     2
+
+#define NGX_CONF_SCRIPT_SNAPSHOT_VOLATILE  0x01
+
+/* Followed by its name (or raw text) then its result, each NUL-terminated,
+ * padded to 8 bytes. */
+typedef struct {
+    uint32_t                 type;
+    uint32_t                 flags;
+    uint32_t                 len;
+    uint32_t                 len2;
+    uint64_t                 size;       /* of the file */
+    u_char                   md5[16];    /* of its contents */
+} ngx_conf_script_snapshot_rec_t;
+
+/* The MD5 of a file opened during the load, while it stays the same. */
+typedef struct {
+    ngx_file_info_t          info;
+    u_char                   md5[16];
+} ngx_conf_script_digest_t;
+
+typedef struct {
+    ngx_str_t                name;
+
+    /* the previous snapshot, as read */
+    u_char                  *map;
+    size_t                   map_size;
+    u_char                  *pos;
+    u_char                  *last;
+    ngx_uint_t               left;       /* records */
+    unsigned                 valid:1;
+    unsigned                 parsed:1;   /* up to the main file's end */
+
+    /* the next one */
+    ngx_array_t              out;
+    ngx_uint_t               nrecs;
+    ngx_conf_script_hash_t   digests;    /* by file name */
+
+    ngx_uint_t               taken;
+    ngx_uint_t               computed;
+} ngx_conf_script_snapshot_t;
+
+
+/* The sets of a variable, foldable while they all set the same value and
+ * nothing else writes it. */
+typedef struct {
+    void                    *var;
+    ngx_str_t                name;
+    ngx_str_t               *value;
+    ngx_array_t              sets;       /* ngx_conf_script_set_code_t */
+    unsigned                 unfoldable:1;
+} ngx_conf_script_fold_t;
+
+
+/* A token as returned by ngx_conf_read_token(), recorded for replay. */
+typedef struct {
+    ngx_int_t                rc;
+    ngx_uint_t               line;
+    ngx_uint_t               nargs;
+    ngx_str_t               *args;
+} ngx_conf_script_token_t;
+
+/* The tokens of a file included more than once, as of its last read. */
+typedef struct {
+    ngx_uint_t               opens;
+    ngx_file_info_t          info;
+    ngx_array_t              tokens;
+    unsigned                 complete:1;
+    unsigned                 recording:1;
+} ngx_conf_script_include_t;
+
+/* The body of a foreach block, replayed for each value. */
+struct ngx_conf_script_loop_s {
+    ngx_conf_script_loop_t  *prev;       /* whose body it is in */
+    ngx_array_t              tokens;
+    ngx_uint_t               next_token;
+};
+
+
+#if (NGX_THREADS)
+
+/* A file read ahead of the parser by the prefetch threads. */
+typedef struct ngx_conf_script_fetch_s  ngx_conf_script_fetch_t;
+
+struct ngx_conf_script_fetch_s {
+    ngx_conf_script_fetch_t *next;       /* in the queue */
+    u_char                  *name;
+    ngx_uint_t               state;
+    unsigned                 linked:1;   /* in the queue */
+    ngx_file_info_t          info;
+    u_char                  *data;       /* NULL if it could not be read */
+    size_t                   size;
+};
+
+#define NGX_CONF_SCRIPT_FETCH_QUEUED   0
+#define NGX_CONF_SCRIPT_FETCH_READING  1
+#define NGX_CONF_SCRIPT_FETCH_DONE     2
+#define NGX_CONF_SCRIPT_FETCH_TAKEN    3 /* by the parser, read or not */
+
+typedef struct {
+    ngx_thread_mutex_t       mtx;
+    ngx_thread_cond_t        queued;
+    ngx_thread_cond_t        done;
+    ngx_conf_script_fetch_t *head;
+    ngx_conf_script_fetch_t **tail;
+    ngx_uint_t               stop;
+    ngx_log_t               *log;
+
+    /* only touched by the parser's thread */
+    pthread_t               *tids;
+    ngx_uint_t               nthreads;
+    ngx_conf_script_hash_t   files;
+    ngx_conf_script_hash_t   globs;      /* queued by the scan */
+    ngx_uint_t               queued_files;
+    ngx_uint_t               hits;
+} ngx_conf_script_prefetch_t;
+
+#endif
+
+struct ngx_conf_script_file_s {
+    ngx_conf_script_file_t  *prev;
+    ngx_conf_file_t         *conf_file;
+    ngx_conf_script_stats_t *stats;
+    ngx_str_t                dir;        /* what . expands to */
+    ngx_conf_script_include_t *record;   /* tokens being recorded */
+    ngx_conf_script_include_t *replay;   /* or being replayed */
+    ngx_uint_t               next_token;
+    ngx_conf_script_loop_t  *loop;       /* body being replayed */
+#if (NGX_THREADS)
+    ngx_conf_script_fetch_t *fetch;
+#endif
+};
+
+
+u_char *ngx_conf_script_find_delim(u_char *p, u_char *last, ngx_str_t *delim);
+int ngx_conf_ccv_compile(ngx_conf_ccv_t *ccv, u_char *open);
+int ngx_conf_ccv_push_part(ngx_conf_ccv_t *ccv, ngx_uint_t type, u_char *start,
+    u_char *end);
 int ngx_conf_ccv_init(ngx_conf_ccv_t *ccv, ngx_conf_t *cf, ngx_str_t *value,
     ngx_uint_t n);
 int ngx_conf_ccv_run(ngx_conf_ccv_t *ccv);
+ngx_int_t ngx_conf_ccv_intern(ngx_conf_ccv_t *ccv, size_t len);
+ngx_int_t ngx_conf_script_intern(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    u_char *data, size_t len, ngx_str_t *result);
 int ngx_conf_ccv_resolve_expr(ngx_conf_ccv_t *ccv, ngx_str_t *expr);
-int ngx_conf_ccv_order_tokens(ngx_conf_ccv_t *ccv,
-    ngx_conf_ccv_token_t *tokens, int start, int end, u_char closer);
-int ngx_conf_ccv_tokens_to_list(ngx_conf_ccv_token_t *tokens, int start,
-    int end);
-int ngx_conf_ccv_resolve_tokens(ngx_conf_ccv_t *ccv,
-    ngx_conf_ccv_token_t *tokens, int n_tokens, ngx_str_t *expr);
-int ngx_conf_ccv_resolve_var(ngx_conf_ccv_t *ccv, ngx_str_t *expr);
-int ngx_conf_ccv_resolve_func(ngx_conf_ccv_t *ccv, int argc, ngx_str_t *argv);
+ngx_conf_ccv_prog_t *ngx_conf_ccv_get_prog(ngx_conf_ccv_t *ccv,
+    ngx_str_t *expr);
+int ngx_conf_ccv_compile_expr(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_prog_t *prog);
+int ngx_conf_ccv_compile_tokens(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_token_t *tokens, int n_tokens, ngx_conf_ccv_prog_t *prog);
+int ngx_conf_ccv_emit(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_prog_t *prog, u_char op, ngx_conf_ccv_token_t *token,
+    int nargs, int *depth);
+int ngx_conf_ccv_oper_len(u_char *p, u_char *last);
+int ngx_conf_ccv_oper_prio(ngx_str_t *oper);
+int ngx_conf_ccv_exec(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog,
+    ngx_str_t *expr);
+int ngx_conf_ccv_resolve_oper(ngx_conf_ccv_t *ccv, int argc, ngx_str_t *argv,
+    ngx_conf_script_num_t *nums);
+int ngx_conf_ccv_resolve_arith(ngx_conf_ccv_t *ccv, ngx_str_t *argv,
+    ngx_conf_script_num_t *nums);
+ngx_int_t ngx_conf_ccv_num(ngx_str_t *val, ngx_conf_script_num_t *num);
+int ngx_conf_ccv_resolve_var(ngx_conf_ccv_t *ccv, ngx_conf_ccv_code_t *code,
+    ngx_str_t *val);
+int ngx_conf_ccv_lookup_var(ngx_conf_ccv_t *ccv, ngx_str_t *name,
+    ngx_str_t *val);
+int ngx_conf_ccv_lookup_sym(ngx_conf_ccv_t *ccv, ngx_int_t sym,
+    ngx_str_t *val);
+ngx_int_t ngx_conf_script_dep_add(ngx_array_t *deps, ngx_str_t *name,
+    ngx_str_t *val);
+int ngx_conf_script_reuse_expand(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string);
+u_char *ngx_conf_script_reuse_key(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string, size_t *len);
+ngx_int_t ngx_conf_script_reuse_find(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, u_char *key, size_t len, ngx_str_t *string,
+    ngx_conf_script_stored_t **found);
+ngx_int_t ngx_conf_script_reuse_store(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, u_char *key, size_t len, ngx_str_t *result,
+    ngx_conf_script_dep_t *deps, ngx_uint_t ndeps);
+void ngx_conf_script_store_cleanup(void *data);
+ngx_conf_script_hash_elt_t *ngx_conf_script_fold_writers(
+    ngx_conf_script_ctx_t *ctx, ngx_str_t *name, ngx_uint_t add);
+int ngx_conf_script_expand(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string);
+void ngx_conf_script_snapshot_map(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_snapshot_t *snap, ngx_conf_t *cf);
+void ngx_conf_script_snapshot_unmap(void *data);
+ngx_conf_script_snapshot_rec_t *ngx_conf_script_snapshot_next(
+    ngx_conf_script_snapshot_t *snap, ngx_uint_t type);
+void ngx_conf_script_snapshot_invalidate(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf);
+ngx_int_t ngx_conf_script_snapshot_append(ngx_conf_script_snapshot_t *snap,
+    ngx_conf_script_snapshot_rec_t *rec, ngx_str_t *s, ngx_str_t *s2);
+ngx_int_t ngx_conf_script_snapshot_file(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf);
+ngx_int_t ngx_conf_script_file_md5(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, u_char *result);
+int ngx_conf_script_snapshot_expand(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, ngx_str_t *string);
+void ngx_conf_script_snapshot_write(ngx_conf_script_ctx_t *ctx);
+void ngx_conf_ccv_resolve_dot(ngx_conf_ccv_t *ccv, ngx_str_t *val);
+void ngx_conf_script_dir(ngx_conf_t *cf, ngx_str_t *dir);
+void ngx_conf_script_file_dir(ngx_str_t *name, ngx_str_t *dir);
+int ngx_conf_ccv_bind_func(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_code_t *code);
+int ngx_conf_ccv_fold_func(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog);
+int ngx_conf_ccv_fold_oper(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog);
+int ngx_conf_ccv_resolve_func(ngx_conf_ccv_t *ccv,
+    ngx_conf_script_func_t *func, int argc, ngx_str_t *argv);
 void ngx_conf_ccv_destroy(ngx_conf_ccv_t *ccv);
-ngx_str_t *ngx_conf_script_var_find(ngx_conf_script_vars_t *vars,
-    ngx_str_t *name);
-ngx_int_t ngx_conf_script_var_pos(ngx_conf_script_vars_t *vars,
+void ngx_conf_script_ctx_cleanup(void *data);
+int ngx_conf_ccv_expand(ngx_conf_t *cf, ngx_str_t *string);
+int ngx_conf_script_profile(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string);
+ngx_conf_script_stats_t *ngx_conf_script_stats_get(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_hash_t *hash, ngx_str_t *name);
+void ngx_conf_script_stats_report(ngx_conf_script_ctx_t *ctx);
+void ngx_conf_script_stats_log(ngx_conf_script_ctx_t *ctx, const char *what,
+    ngx_str_t *name, ngx_conf_script_stats_t *stats);
+int ngx_conf_script_stats_cmp(const void *one, const void *two);
+ngx_conf_script_var_t *ngx_conf_script_var_find(
+    ngx_conf_script_vars_t *vars, ngx_uint_t sym, ngx_uint_t *depth);
+ngx_conf_script_var_t *ngx_conf_script_var_add(ngx_conf_t *cf,
+    ngx_conf_script_vars_t *vars, ngx_str_t *name);
+int ngx_conf_ccv_expand_define(ngx_conf_ccv_t *ccv,
+    ngx_conf_script_var_t *var, ngx_str_t *val);
+int ngx_conf_ccv_define_valid(ngx_conf_ccv_t *ccv,
+    ngx_conf_script_define_t *def);
+ngx_conf_script_map_t *ngx_conf_script_map_copy(ngx_pool_t *pool,
+    ngx_conf_script_vars_t *vars, ngx_conf_script_map_t *node,
+    uint32_t bit);
+ngx_uint_t ngx_conf_script_popcount(uint32_t bits);
+ngx_int_t ngx_conf_script_include_start(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_file_t *file);
+void ngx_conf_script_include_abort(ngx_conf_script_file_t *file);
+ngx_int_t ngx_conf_script_include_record(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, ngx_int_t rc);
+ngx_int_t ngx_conf_script_include_replay(ngx_conf_t *cf,
+    ngx_conf_script_file_t *file);
+ngx_int_t ngx_conf_script_token_copy(ngx_pool_t *pool, ngx_conf_t *cf,
+    ngx_int_t rc, ngx_array_t *tokens);
+ngx_int_t ngx_conf_script_token_replay(ngx_conf_t *cf,
+    ngx_conf_script_token_t *token);
+ngx_int_t ngx_conf_script_loop_replay(ngx_conf_t *cf,
+    ngx_conf_script_loop_t *loop);
+ngx_int_t ngx_conf_script_block_read(ngx_conf_t *cf, ngx_array_t *tokens);
+#if (NGX_THREADS)
+ngx_int_t ngx_conf_script_prefetch_add(ngx_conf_script_ctx_t *ctx,
     ngx_str_t *name);
+ngx_int_t ngx_conf_script_prefetch_scan(ngx_conf_t *cf, u_char *p,
+    u_char *last);
+ngx_int_t ngx_conf_script_prefetch_include(ngx_conf_t *cf, ngx_str_t *arg,
+    ngx_str_t *open);
+ngx_int_t ngx_conf_script_prefetch_matches(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf, ngx_str_t *pattern);
+ngx_conf_script_fetch_t *ngx_conf_script_prefetch_take(
+    ngx_conf_script_ctx_t *ctx, ngx_conf_file_t *conf_file);
+void ngx_conf_script_prefetch_release(ngx_conf_script_fetch_t *fetch);
+void *ngx_conf_script_prefetch_thread(void *data);
+void ngx_conf_script_prefetch_read(ngx_conf_script_fetch_t *fetch,
+    ngx_log_t *log);
+void ngx_conf_script_prefetch_stop(ngx_conf_script_ctx_t *ctx);
+#endif
 #define ngx_array_get(type, a, pos) (((type *)(a)->elts)[pos])
 
 
-static u_char charclass[256];
-static u_char *charclass_p = NULL;
+struct ngx_conf_script_arena_block_s {
+    ngx_conf_script_arena_block_t  *next;
+    u_char                         *end;
+};
 
 
-void *
-ngx_conf_script_init(ngx_cycle_t *cycle)
+/* State shared by all evaluations of a single configuration load. It lives
+ * in the cycle's temp pool, and is forgotten as soon as that pool goes. */
+
+struct ngx_conf_script_ctx_s {
+    ngx_cycle_t             *cycle;
+    ngx_pool_t              *pool;
+    ngx_log_t               *log;
+    ngx_conf_script_hash_t   syms;
+    ngx_uint_t               nsyms;
+    ngx_conf_script_hash_t   progs;
+    ngx_uint_t               prog_hits;
+    ngx_uint_t               prog_misses;
+    ngx_conf_script_hash_t   funcs;
+    ngx_conf_script_hash_t   memo;       /* pure functions' results */
+    ngx_uint_t               memo_hits;
+    ngx_conf_script_hash_t   interned;   /* results, by contents */
+    size_t                   interned_saved;
+
+    /* define being expanded */
+    ngx_conf_script_define_t *define;
+
+    /* evaluation scratch: allocated blocks are kept for reuse until the
+     * load ends, only the final strings go to cf->pool */
+    ngx_conf_script_arena_block_t  *arena;
+    ngx_conf_script_mark_t   arena_top;
+    u_char                  *arena_end;
+    size_t                   arena_peak;
+
+    ngx_conf_script_file_t  *file;
+    ngx_conf_script_read_token_pt read_token; /* the core's */
+    ngx_uint_t               ntokens;    /* read through it */
+    ngx_uint_t               branch;     /* ntokens after the last static_if */
+    unsigned                 branch_taken:1;
+    ngx_conf_script_stats_t  total;
+    unsigned                 stats:1;
+    struct timeval           start;
+    ngx_conf_script_hash_t   file_stats;
+    ngx_conf_script_hash_t   directive_stats;
+
+    /* includes by name */
+    ngx_conf_script_hash_t   includes;
+    ngx_uint_t               replayed;
+
+    /* expansions kept for the next load, and what the current one read */
+    ngx_conf_script_store_t *store;
+    ngx_array_t              deps;
+    unsigned                 recording:1;
+    unsigned                 volatile_:1;
+    ngx_uint_t               reused;
+    ngx_uint_t               recomputed;
+
+    ngx_conf_script_snapshot_t *snapshot;
+    ngx_uint_t               opened;     /* files */
+
+    /* rewrite sets, by variable, while folding them, and how many
+     * directives write each variable, by lowercase name */
+    ngx_conf_script_hash_t   folds;
+    ngx_conf_script_hash_t   writers;
+    unsigned                 fold:1;
+    ngx_uint_t               sets;
+    ngx_uint_t               sets_folded;
+    ngx_uint_t               sets_dropped;
+
+#if (NGX_THREADS)
+    ngx_conf_script_prefetch_t *prefetch;
+#endif
+};
+
+
+/* Character classes of expression tokens: constant, so that evaluations may
+ * run concurrently. */
+
+#define A  T_ALPHA
+#define N  T_NUM
+#define P  T_PAR
+#define O  T_OPER
+#define Q  T_QUOTE
+
+static const u_char  charclass[256] = {
+    /* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x20 */ 0, O, Q, A, A, O, O, Q, P, ')', O, O, ',', O, A, O,
+    /* 0x30 */ N, N, N, N, N, N, N, N, N, N, A, A, O, O, O, A,
+    /* 0x40 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0x50 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0x60 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0x70 */ A, A, A, A, A, A, A, A, A, A, A, A, O, A, A, A,
+    /* 0x80 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0x90 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xa0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xb0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xc0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xd0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xe0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    /* 0xf0 */ A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+};
+
+#undef A
+#undef N
+#undef P
+#undef O
+#undef Q
+
+static const ngx_uint_t  argument_number[] = {
+    NGX_CONF_NOARGS,
+    NGX_CONF_TAKE1,
+    NGX_CONF_TAKE2,
+    NGX_CONF_TAKE3,
+    NGX_CONF_TAKE4,
+    NGX_CONF_TAKE5,
+    NGX_CONF_TAKE6,
+    NGX_CONF_TAKE7
+};
+
+
+/* Expands string's scripts into a buffer of its own, which the caller may
+ * modify in place. */
+
+int
+ngx_conf_complex_value(ngx_conf_t *cf, ngx_str_t *string)
 {
-    int pos;
-    for (pos = 256; --pos > ' ';) {
-        charclass[pos] = T_ALPHA;
-    }
-    while(--pos >= 0) {
-        charclass[pos] = 0;
+    int      rc;
+    u_char  *raw, *p;
+
+    raw = string->data;
+
+    rc = ngx_conf_complex_value_shared(cf, string);
+    if (rc != NGX_OK || string->data == raw) {
+        return rc;
     }
 
-    for (pos = '0'; pos <= '9'; ++pos) {
-        charclass[pos] = T_NUM;
+    p = ngx_pnalloc(cf->pool, string->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    charclass['('] = T_PAR;
-    charclass[')'] = ')';
-    charclass[','] = ',';
+    ngx_memcpy(p, string->data, string->len);
+    p[string->len] = '\0';
+    string->data = p;
 
-    return charclass;
+    return NGX_OK;
 }
 
 
+/* Expands string's scripts, the result possibly being shared with other
+ * identical ones (interned, reused from the previous cycle, or mapped from
+ * a snapshot): it must not be modified. */
+
 int
-ngx_conf_complex_value(ngx_conf_t *cf, ngx_str_t *string)
+ngx_conf_complex_value_shared(ngx_conf_t *cf, ngx_str_t *string)
 {
-    ngx_uint_t      i, nv;
-    ngx_conf_ccv_t  ccv;
-    u_char         *delim_ptr;
-    u_char         *delim_end;
+    ngx_conf_script_ctx_t  *ctx;
 
     if (!cf->conf_file->script_delim) {
         return NGX_OK;
     }
 
-    nv = 0;
+    ctx = cf->cycle->conf_script;
+    if (ctx) {
+        ++ctx->total.calls;
+        if (ctx->snapshot && ctx->define == NULL) {
+            return ngx_conf_script_snapshot_expand(ctx, cf, string);
+        }
+    }
 
-    delim_ptr = cf->conf_file->script_delim->open.data;
-    delim_end = &delim_ptr[cf->conf_file->script_delim->open.len];
-    for (i = 0; i < string->len - 1; ++i) {
-        if (string->data[i] == *delim_ptr) {
-            do {
-                if (++delim_ptr == delim_end) {
-                    ++nv;
-                    break;
-                }
-                ++i;
-            } while (string->data[i] == *delim_ptr);
-            delim_ptr = cf->conf_file->script_delim->open.data;
+    return ngx_conf_script_expand(ctx, cf, string);
+}
+
+
+int
+ngx_conf_script_expand(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string)
+{
+    if (ctx) {
+        if (ctx->store && !ctx->recording && ctx->define == NULL) {
+            return ngx_conf_script_reuse_expand(ctx, cf, string);
+        }
+        if (ctx->stats && ctx->define == NULL) {
+            return ngx_conf_script_profile(ctx, cf, string);
         }
     }
 
-    if (nv == 0) {
+    return ngx_conf_ccv_expand(cf, string);
+}
+
+
+int
+ngx_conf_ccv_expand(ngx_conf_t *cf, ngx_str_t *string)
+{
+    ngx_conf_ccv_t  ccv;
+    u_char         *open;
+
+    /* Most arguments have no script at all: this is the only pass they
+     * pay for. */
+    open = ngx_conf_script_find_delim(string->data,
+                                      string->data + string->len,
+                                      &cf->conf_file->script_delim->open);
+    if (open == NULL) {
         return NGX_OK;
     }
 
-    if (ngx_conf_ccv_init(&ccv, cf, string, 2 * nv + 1) != NGX_OK) {
+    if (ngx_conf_ccv_init(&ccv, cf, string, 4) != NGX_OK) {
     	goto e_ccv;
     }
 
-    if (ngx_conf_ccv_compile(&ccv) != NGX_OK) {
+    if (ngx_conf_ccv_compile(&ccv, open) != NGX_OK) {
     	goto e_compile;
     }
 
@@ -152,161 +684,160 @@ ngx_conf_ccv_init(ngx_conf_ccv_t *ccv, ngx_conf_t *cf, ngx_str_t *value,
     ccv->value = value;
     ccv->cf = cf;
 
-    if (ngx_array_init(&ccv->parts, cf->pool, n, sizeof(ngx_str_t)) != NGX_OK) {
-        goto e_alloc_parts;
+    ccv->ctx = ngx_conf_script_get_ctx(cf);
+    if (ccv->ctx == NULL) {
+        return NGX_ERROR;
     }
-    if (ngx_array_init(&ccv->part_types, cf->pool, n, sizeof(ngx_uint_t))
-        != NGX_OK)
-    {
-        goto e_alloc_part_types;
+
+    ++ccv->ctx->total.expanded;
+
+    ngx_conf_script_mark(ccv->ctx, &ccv->mark);
+
+    ccv->parts = ngx_conf_script_alloc(ccv->ctx,
+                                       n * sizeof(ngx_conf_ccv_part_t));
+    if (ccv->parts == NULL) {
+        return NGX_ERROR;
     }
+    ccv->nparts = 0;
+    ccv->nalloc = n;
 
     return NGX_OK;
-
-    ngx_array_destroy(&ccv->part_types);
-e_alloc_part_types:
-    ngx_array_destroy(&ccv->parts);
-e_alloc_parts:
-    return NGX_ERROR;
 }
 
 
 void
 ngx_conf_ccv_destroy(ngx_conf_ccv_t *ccv)
 {
-    ngx_array_destroy(&ccv->parts);
-    ngx_array_destroy(&ccv->part_types);
+    ngx_conf_script_release(ccv->ctx, &ccv->mark);
 }
 
 
-ngx_uint_t
-ngx_conf_to_past_delim(ngx_str_t *string, ngx_uint_t *pos, ngx_str_t * delim)
-{
-    ngx_uint_t      i = *pos;
-    u_char         *delim_pos = delim->data;
-    ngx_uint_t       delim_remaining;
-
-    while (i < string->len) {
-        if (string->data[i] == *delim_pos) {
-            *pos = i;
-            for (delim_remaining = delim->len; /* void */ ; /* void */ ) {
-                ++delim_pos;
-                ++i;
-                if (--delim_remaining == 0) {
-                    return i;
-                }
-                if (i >= string->len) {
-                    break;
-                }
-                if (string->data[i] != *delim_pos) {
-                    break;
-                }
-            }
-        } else {
-            ++i;
+/* Finds the first occurrence of delim in [p, last[: memchr() (vectorized by
+ * any decent libc) jumps to candidates for the first byte, and the tail is
+ * then compared in place. Restarting right after a failed candidate keeps
+ * overlapping delimiters (<< in <<<) found. */
+
+u_char *
+ngx_conf_script_find_delim(u_char *p, u_char *last, ngx_str_t *delim)
+{
+    size_t  tail;
+
+    tail = delim->len - 1;
+
+    while ((size_t) (last - p) > tail) {
+        p = memchr(p, delim->data[0], last - p - tail);
+        if (p == NULL) {
+            return NULL;
         }
+        if (ngx_memcmp(p + 1, delim->data + 1, tail) == 0) {
+            return p;
+        }
+        ++p;
     }
 
-    *pos = i;
-
-    return i;
+    return NULL;
 }
 
 
+/* Splits the value into text and expression parts, in a single pass which
+ * starts at open, the first opening delimiter already found by the
+ * caller. */
+
 int
-ngx_conf_ccv_compile(ngx_conf_ccv_t *ccv)
+ngx_conf_ccv_compile(ngx_conf_ccv_t *ccv, u_char *open)
 {
-    ngx_uint_t      i, current_part_start, current_part_end, next_part_start;
-    ngx_uint_t      prev_part_end;
-    ngx_uint_t      current_part_type;
+    u_char                   *start, *end, *last, *close;
+    ngx_conf_script_delim_t  *delim;
 
-    ccv->parts.nelts          = 0;
-    ccv->part_types.nelts     = 0;
-    current_part_type    = NGX_CONF_TYPE_TEXT;
+    delim = ccv->cf->conf_file->script_delim;
 
-    for (current_part_start = 0; current_part_start < ccv->value->len;
-    	/* void */ )
-    {
-    	switch (current_part_type) {
-    	
-    	case NGX_CONF_TYPE_TEXT:
+    ccv->nparts = 0;
 
-            current_part_end = current_part_start;
-            next_part_start = ngx_conf_to_past_delim(ccv->value,
-                &current_part_end, &ccv->cf->conf_file->script_delim->open);
-    		
-            if (current_part_end > current_part_start) {
-    			((ngx_str_t *) ccv->parts.elts)[ccv->parts.nelts].data =
-    				&ccv->value->data[current_part_start];
-    			((ngx_str_t *) ccv->parts.elts)[ccv->parts.nelts].len =
-                    current_part_end - current_part_start;
-    			++ccv->parts.nelts;
-    			((ngx_uint_t *) ccv->part_types.elts)[ccv->part_types.nelts] =
-    				current_part_type;
-    			++ccv->part_types.nelts;
-    		}
-            if (next_part_start > current_part_end) {
-    			current_part_type = NGX_CONF_TYPE_EXPR;
-    		}
-            current_part_start = next_part_start;
-    		
-    		break;
-    		
-    	case NGX_CONF_TYPE_EXPR:
-    	
-            prev_part_end = current_part_end;
-            current_part_end = current_part_start;
-            next_part_start = ngx_conf_to_past_delim(ccv->value,
-                &current_part_end, &ccv->cf->conf_file->script_delim->close);
-            if (next_part_start == current_part_end) {
-    			ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-                   "unbalanced %V in \"%V\" at character %d",
-                   &ccv->cf->conf_file->script_delim->close, ccv->value,
-                   prev_part_end + 1);
-    			goto e_script_parse;
-    		}
-    		
-    		while (current_part_start < ccv->value->len
-    			&& ccv->value->data[current_part_start] == ' ')
-    		{
-    			++current_part_start;
-    		}
-            for ( /* void */ ;
-    			current_part_end > current_part_start
-    				&& ccv->value->data[current_part_end - 1] == ' ';
-    			--current_part_end)
-    		{
-    			/* void */
-    		}
-    		
-    		if (current_part_end <= current_part_start) {
-    			ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-    			   "invalid variable name in \"%V\" at character %d",
-    			   ccv->value, current_part_start + 1);
-    			goto e_script_parse;
-    		}
-    		
-    		((ngx_str_t *) ccv->parts.elts)[ccv->parts.nelts].data =
-    			&ccv->value->data[current_part_start];
-    		((ngx_str_t *) ccv->parts.elts)[ccv->parts.nelts].len =
-    			current_part_end - current_part_start;
-    		++ccv->parts.nelts;
-    		((ngx_uint_t *) ccv->part_types.elts)[ccv->part_types.nelts] =
-    			current_part_type;
-    		++ccv->part_types.nelts;
-    		
-            current_part_start = next_part_start;
-    		current_part_type = NGX_CONF_TYPE_TEXT;
-    		
-    		break;
-    	}
+    last = ccv->value->data + ccv->value->len;
+
+    for (start = ccv->value->data; /* void */ ; /* void */ ) {
+
+        if (open > start) {
+            if (ngx_conf_ccv_push_part(ccv, NGX_CONF_TYPE_TEXT, start, open)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (open == last) {
+            break;
+        }
+
+        start = open + delim->open.len;
+
+        close = ngx_conf_script_find_delim(start, last, &delim->close);
+        if (close == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                               "unbalanced %V in \"%V\" at character %d",
+                               &delim->close, ccv->value,
+                               open - ccv->value->data + 1);
+            return NGX_ERROR;
+        }
+
+        for (end = close; end > start && end[-1] == ' '; --end) {
+            /* void */
+        }
+        while (start < end && *start == ' ') {
+            ++start;
+        }
+
+        if (end <= start) {
+            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                               "invalid variable name in \"%V\" "
+                               "at character %d",
+                               ccv->value, start - ccv->value->data + 1);
+            return NGX_ERROR;
+        }
+
+        if (ngx_conf_ccv_push_part(ccv, NGX_CONF_TYPE_EXPR, start, end)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        start = close + delim->close.len;
+
+        open = ngx_conf_script_find_delim(start, last, &delim->open);
+        if (open == NULL) {
+            open = last;
+        }
     }
 
     return NGX_OK;
+}
 
-e_script_parse:
 
-    return NGX_ERROR;
+int
+ngx_conf_ccv_push_part(ngx_conf_ccv_t *ccv, ngx_uint_t type, u_char *start,
+    u_char *end)
+{
+    ngx_conf_ccv_part_t  *parts;
+
+    if (ccv->nparts == ccv->nalloc) {
+        parts = ngx_conf_script_alloc(ccv->ctx,
+                                      2 * ccv->nalloc
+                                      * sizeof(ngx_conf_ccv_part_t));
+        if (parts == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(parts, ccv->parts,
+                   ccv->nparts * sizeof(ngx_conf_ccv_part_t));
+        ccv->parts = parts;
+        ccv->nalloc *= 2;
+    }
+
+    ccv->parts[ccv->nparts].type = type;
+    ccv->parts[ccv->nparts].val.data = start;
+    ccv->parts[ccv->nparts].val.len = end - start;
+    ++ccv->nparts;
+
+    return NGX_OK;
 }
 
 
@@ -316,20 +847,19 @@ ngx_conf_ccv_run(ngx_conf_ccv_t *ccv)
     ngx_uint_t      i;
     ngx_str_t      *val;
     size_t          len;
-    unsigned char  *ptr;
 
     len = 0;
 
-    for (i = 0; i < ccv->part_types.nelts; ++i) {
-    	switch (((ngx_uint_t *) ccv->part_types.elts)[i]) {
+    for (i = 0; i < ccv->nparts; ++i) {
+    	switch (ccv->parts[i].type) {
     	
     	case NGX_CONF_TYPE_TEXT:
-    		val = &((ngx_str_t *) ccv->parts.elts)[i];
+    		val = &ccv->parts[i].val;
     		len += val->len;
     		break;
     		
     	case NGX_CONF_TYPE_EXPR:
-    		val = &(((ngx_str_t *) ccv->parts.elts)[i]);
+    		val = &ccv->parts[i].val;
     		if (ngx_conf_ccv_resolve_expr(ccv, val) != NGX_OK) {
     			return NGX_ERROR;
     		}
@@ -338,39 +868,148 @@ ngx_conf_ccv_run(ngx_conf_ccv_t *ccv)
     	}
     }
 
-    ptr = ngx_pnalloc(ccv->cf->pool, len + 1);
-    if (ptr == NULL) {
+    /* A lone part is interned as is: a result interned before, as a static
+     * set from an expansion, comes back without a copy. */
+    if (ccv->nparts == 1) {
+        val = &ccv->parts[0].val;
+        return ngx_conf_script_intern(ccv->ctx, ccv->cf, val->data, val->len,
+                                      ccv->value);
+    }
+
+    return ngx_conf_ccv_intern(ccv, len);
+}
+
+
+/* Interns the concatenation of the parts, len bytes, as a rope: it is hashed
+ * and compared part by part, and only flattened, right into cf->pool, when
+ * it is a result not seen yet. */
+
+ngx_int_t
+ngx_conf_ccv_intern(ngx_conf_ccv_t *ccv, size_t len)
+{
+    u_char                      *p, *q;
+    ngx_uint_t                   i, key;
+    ngx_str_t                   *val;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    key = 0;
+    for (i = 0; i < ccv->nparts; ++i) {
+        val = &ccv->parts[i].val;
+        for (p = val->data; p < val->data + val->len; ++p) {
+            key = ngx_hash(key, *p);
+        }
+    }
+
+    if (ccv->cf->pool == ccv->cf->cycle->pool) {
+        for (elt = ccv->ctx->interned.buckets[key
+                                          & (ccv->ctx->interned.size - 1)];
+             elt;
+             elt = elt->next)
+        {
+            if (elt->key != key || elt->name.len != len) {
+                continue;
+            }
+
+            for (i = 0, q = elt->name.data; i < ccv->nparts; ++i) {
+                val = &ccv->parts[i].val;
+                if (ngx_memcmp(q, val->data, val->len) != 0) {
+                    break;
+                }
+                q += val->len;
+            }
+
+            if (i == ccv->nparts) {
+                ccv->ctx->interned_saved += len + 1;
+                ccv->value->data = elt->value;
+                ccv->value->len = len;
+                return NGX_OK;
+            }
+        }
+    }
+
+    p = ngx_pnalloc(ccv->cf->pool, len + 1);
+    if (p == NULL) {
         return NGX_ERROR;
     }
+    ccv->ctx->total.bytes += len + 1;
+
+    for (i = 0, q = p; i < ccv->nparts; ++i) {
+        val = &ccv->parts[i].val;
+        q = ngx_copy(q, val->data, val->len);
+    }
+    *q = '\0';
+
+    if (ccv->cf->pool == ccv->cf->cycle->pool) {
+        elt = ngx_conf_script_hash_add(&ccv->ctx->interned, key, p, len);
+        if (elt == NULL) {
+            return NGX_ERROR;
+        }
+        elt->value = p;
+    }
 
+    ccv->value->data = p;
     ccv->value->len = len;
-    ccv->value->data = ptr;
 
-    for (i = 0; i < ccv->part_types.nelts; ++i) {
-    	switch (((ngx_uint_t *) ccv->part_types.elts)[i]) {
-    	
-    	case NGX_CONF_TYPE_TEXT:
-    	case NGX_CONF_TYPE_EXPR:
-    		val = &((ngx_str_t *) ccv->parts.elts)[i];
-    		ptr = ngx_copy(ptr, val->data, val->len);
-    		break;
-    	}
+    return NGX_OK;
+}
+
+
+/* Gives the copy in cf->pool of a result, shared with any identical one:
+ * configurations repeating the same roots, includes or names across many
+ * servers get one buffer for them all, which directives must thus not
+ * modify in place. Pools of a block's own (as geo's) are left alone. */
+
+ngx_int_t
+ngx_conf_script_intern(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    u_char *data, size_t len, ngx_str_t *result)
+{
+    u_char                      *p;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    elt = NULL;
+
+    if (cf->pool == cf->cycle->pool) {
+        elt = ngx_conf_script_hash_add(&ctx->interned,
+                                       ngx_hash_key(data, len), data, len);
+        if (elt == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (elt->value) {
+            ctx->interned_saved += len + 1;
+            result->data = elt->value;
+            result->len = len;
+            return NGX_OK;
+        }
+    }
+
+    p = ngx_pnalloc(cf->pool, len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->total.bytes += len + 1;
+
+    ngx_memcpy(p, data, len);
+    p[len] = '\0';
+
+    if (elt) {
+        elt->value = p;
     }
 
-    ccv->value->data[ccv->value->len] = 0;
+    result->data = p;
+    result->len = len;
 
     return NGX_OK;
 }
 
 
 void
-ngx_conf_ccv_print_tokens(ngx_conf_ccv_token_t *tokens, int start, int end)
+ngx_conf_ccv_print_codes(ngx_conf_ccv_prog_t *prog)
 {
-    int pos;
-    for (--start; ++start < end;) {
-        if(!tokens[start].type) continue;
-        fprintf(stderr, "  [%c] %d->%d:\t", tokens[start].type, start, tokens[start].n_ops ? tokens[start].n_ops + start - 1 : 0);
-        fwrite(tokens[start].text.data, 1, tokens[start].text.len, stderr);
+    ngx_conf_ccv_code_t *code;
+    for (code = prog->codes; code->op != NGX_CONF_CCV_END; ++code) {
+        fprintf(stderr, "  [%d] %d:\t", code->op, code->nargs);
+        fwrite(code->text.data, 1, code->text.len, stderr);
         fprintf(stderr, "\n");
     }
 }
@@ -379,29 +1018,140 @@ ngx_conf_ccv_print_tokens(ngx_conf_ccv_token_t *tokens, int start, int end)
 int
 ngx_conf_ccv_resolve_expr(ngx_conf_ccv_t *ccv, ngx_str_t *expr)
 {
-    ngx_int_t pos, end;
-    ngx_uint_t *lengths = (ngx_uint_t *)alloca(expr->len * sizeof(ngx_uint_t));
-    ngx_conf_ccv_token_t *tokens;
+    ngx_conf_ccv_prog_t *prog;
 
-    if (!charclass_p) {
-        ngx_conf_script_init(NULL);
-        charclass_p = charclass;
+    ++ccv->ctx->total.exprs;
+
+    prog = ngx_conf_ccv_get_prog(ccv, expr);
+    if (prog == NULL) {
+        return NGX_ERROR;
     }
 
-    /* get token lengths */
-    for (pos = -1; ++pos < expr->len;) {
-        switch (charclass[expr->data[pos]]) {
-            case T_ALPHA:
-            case T_NUM:
-                for (end = pos;
-                    ++end < expr->len
-                    && (charclass[expr->data[end]] == T_ALPHA || charclass[expr->data[end]] == T_NUM);
-                    /* void */ ) {
-                    lengths[end] = 0;
+    return ngx_conf_ccv_exec(ccv, prog, expr);
+}
+
+
+ngx_conf_ccv_prog_t *
+ngx_conf_ccv_get_prog(ngx_conf_ccv_t *ccv, ngx_str_t *expr)
+{
+    int                          i;
+    ngx_uint_t                   key;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+    ngx_conf_script_mark_t       mark;
+    ngx_conf_ccv_prog_t          prog, *cached;
+
+    ctx = ccv->ctx;
+
+    key = ngx_hash_key(expr->data, expr->len);
+    elt = ngx_conf_script_hash_find(&ctx->progs, key, expr->data, expr->len);
+    if (elt) {
+        ++ctx->prog_hits;
+        return elt->value;
+    }
+
+    ngx_conf_script_mark(ctx, &mark);
+
+    if (ngx_conf_ccv_compile_expr(ccv, expr, &prog) != NGX_OK) {
+        ngx_conf_script_release(ctx, &mark);
+        return NULL;
+    }
+
+    elt = ngx_conf_script_hash_add(&ctx->progs, key, expr->data, expr->len);
+    if (elt == NULL) {
+        return NULL;
+    }
+    cached = ngx_palloc(ctx->pool, sizeof(ngx_conf_ccv_prog_t)
+                        + (prog.n_codes + 1) * sizeof(ngx_conf_ccv_code_t));
+    if (cached == NULL) {
+        return NULL;
+    }
+
+    /* Move the codes out of the scratch arena, rebasing them on the hash's
+     * copy of the expression, as the original will be gone with the
+     * configuration buffer. Folded constants already live in ctx->pool. */
+    cached->codes = (ngx_conf_ccv_code_t *) &cached[1];
+    cached->n_codes = prog.n_codes;
+    cached->depth = prog.depth;
+    for (i = 0; i <= prog.n_codes; ++i) {
+        cached->codes[i] = prog.codes[i];
+        if (prog.codes[i].text.data >= expr->data
+            && prog.codes[i].text.data <= expr->data + expr->len)
+        {
+            cached->codes[i].text.data = elt->name.data
+                                    + (prog.codes[i].text.data - expr->data);
+        }
+    }
+
+    ngx_conf_script_release(ctx, &mark);
+
+    elt->value = cached;
+    ++ctx->prog_misses;
+
+    return cached;
+}
+
+
+int
+ngx_conf_ccv_compile_expr(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_prog_t *prog)
+{
+    ngx_uint_t pos, end;
+    ngx_uint_t *lengths;
+    ngx_conf_ccv_token_t *tokens;
+
+    lengths = ngx_conf_script_alloc(ccv->ctx, expr->len * sizeof(ngx_uint_t));
+    if (lengths == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* get token lengths */
+    for (pos = 0; pos < expr->len; ++pos) {
+        switch (charclass[expr->data[pos]]) {
+            case T_ALPHA:
+            case T_NUM:
+                /* a - between letters or digits belongs to a name */
+                for (end = pos;
+                    ++end < expr->len
+                    && (charclass[expr->data[end]] == T_ALPHA || charclass[expr->data[end]] == T_NUM
+                        || (expr->data[end] == '-' && charclass[expr->data[pos]] == T_ALPHA
+                            && end + 1 < expr->len
+                            && (charclass[expr->data[end + 1]] == T_ALPHA
+                                || charclass[expr->data[end + 1]] == T_NUM)));
+                    /* void */ ) {
+                    lengths[end] = 0;
                 }
                 lengths[pos] = end - pos;
                 pos = end - 1;
                 break;
+            case T_QUOTE:
+                for (end = pos;
+                    ++end < expr->len && expr->data[end] != expr->data[pos];
+                    /* void */ ) {
+                    lengths[end] = 0;
+                }
+                if (end == expr->len) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                        "cannot resolve {{ %V }}: unterminated string", expr);
+                    return NGX_ERROR;
+                }
+                lengths[end] = 0;
+                lengths[pos] = end + 1 - pos;
+                pos = end;
+                break;
+            case T_OPER:
+                lengths[pos] = ngx_conf_ccv_oper_len(&expr->data[pos],
+                                                    expr->data + expr->len);
+                if (lengths[pos] == 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                        "cannot resolve {{ %V }}: unknown operator at "
+                        "position %ui", expr, pos);
+                    return NGX_ERROR;
+                }
+                if (lengths[pos] == 2) {
+                    lengths[++pos] = 0;
+                }
+                break;
             case 0:
                 lengths[pos] = 0;
                 break;
@@ -412,353 +1162,4413 @@ ngx_conf_ccv_resolve_expr(ngx_conf_ccv_t *ccv, ngx_str_t *expr)
     }
 
     /* get tokens */
-    for (end = 0, pos = -1; ++pos < expr->len;) {
+    for (end = 0, pos = 0; pos < expr->len; ++pos) {
         if (lengths[pos])
             ++end;
     }
-    tokens = (ngx_conf_ccv_token_t *)alloca(end * sizeof(ngx_conf_ccv_token_t));
-    for (end = 0, pos = -1; ++pos < expr->len;) {
+    tokens = ngx_conf_script_alloc(ccv->ctx,
+                                   end * sizeof(ngx_conf_ccv_token_t));
+    if (tokens == NULL) {
+        return NGX_ERROR;
+    }
+    for (end = 0, pos = 0; pos < expr->len; ++pos) {
         if (lengths[pos]) {
             tokens[end].type = charclass[expr->data[pos]];
-            tokens[end].n_ops = 0;
             tokens[end].text.data = &expr->data[pos];
             tokens[end].text.len = lengths[pos];
+            if (tokens[end].type == T_QUOTE) {
+                tokens[end].type = T_CONST;
+                ++tokens[end].text.data;
+                tokens[end].text.len -= 2;
+            }
             ++end;
         }
     }
 
-    /* reorder tokens in polish notation */
-    pos = ngx_conf_ccv_order_tokens(ccv, tokens, 0, end, T_END);
-    if (pos < end) {
-        if (pos >= 0)
-            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-                "cannot resolve {{ %V }}: unexpected token at position %d",
-                expr, tokens[pos].text.data - expr->data);
-    	return NGX_ERROR;
-    }
-
-    return ngx_conf_ccv_resolve_tokens(ccv, tokens, end, expr);
+    return ngx_conf_ccv_compile_tokens(ccv, expr, tokens, end, prog);
 }
 
 
+/* Compiles tokens into postfix codes in a single pass: operands are output
+ * as they come, while operators, parentheses and calls wait on a stack (as
+ * deep as there are tokens at most) until what binds tighter has been
+ * output. Calls get bound to their function as they are output. */
+
 int
-ngx_conf_ccv_order_tokens(ngx_conf_ccv_t *ccv,
-    ngx_conf_ccv_token_t *tokens, int start, int end, u_char closer)
+ngx_conf_ccv_compile_tokens(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_token_t *tokens, int n_tokens, ngx_conf_ccv_prog_t *prog)
 {
-    int pos, pos2, prio;
-    int pos_max, prio_max;
-    ngx_conf_ccv_token_t token;
+    int                      pos, top, prio, operand, unary, depth;
+    u_char                   op;
+    ngx_conf_ccv_token_t    *token;
+    ngx_conf_ccv_pending_t  *stack;
 
-    for (pos = start, pos_max = -1, prio_max = -1;
-            pos < end && tokens[pos].type != closer;
-            /* void */ )
-    {
-        /* Parenthesis are immediately reduced */
-        if (tokens[pos].type == T_PAR) {
-            if ((pos2 = ngx_conf_ccv_order_tokens(ccv, tokens, pos + 1, end, ')')) < 0)
-                return pos2;
-            if (pos2 >= end || tokens[pos2].type != ')') {
-                ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-                    "missing closing parenthesis");
-                return -1;
+    if (n_tokens == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+            "cannot resolve {{ %V }}: empty expression", expr);
+        return NGX_ERROR;
+    }
+
+    stack = ngx_conf_script_alloc(ccv->ctx,
+                                  n_tokens * sizeof(ngx_conf_ccv_pending_t));
+    prog->codes = ngx_conf_script_alloc(ccv->ctx,
+                               (n_tokens + 1) * sizeof(ngx_conf_ccv_code_t));
+    if (stack == NULL || prog->codes == NULL) {
+        return NGX_ERROR;
+    }
+    prog->n_codes = 0;
+    prog->depth = 0;
+
+    depth = 0;
+    top = 0;
+    operand = 1; /* expected next */
+
+    for (pos = 0; pos < n_tokens; ++pos) {
+        token = &tokens[pos];
+
+        switch (token->type) {
+
+        case T_ALPHA:
+        case T_NUM:
+        case T_CONST:
+            if (!operand) {
+                goto unexpected;
+            }
+
+            if (token->type == T_ALPHA && pos + 1 < n_tokens
+                && tokens[pos + 1].type == T_PAR)
+            {
+                stack[top].token = token;
+                stack[top].prio = 0;
+                stack[top].nargs = 0;
+                ++top;
+                ++pos;
+
+                if (pos + 1 < n_tokens && tokens[pos + 1].type == ')') {
+                    ++pos;
+                    --top;
+                    if (ngx_conf_ccv_emit(ccv, expr, prog, NGX_CONF_CCV_CALL,
+                                          token, 0, &depth)
+                        != NGX_OK)
+                    {
+                        return NGX_ERROR;
+                    }
+                    operand = 0;
+                }
+                break;
             }
-            tokens[pos2].type = 0;
-            ++pos2;
-            if (pos > start && tokens[pos - 1].type == T_ALPHA) {
-                --pos;
-                tokens[pos].type = T_FUNC;
-                tokens[pos].n_ops = pos2 - pos;
-                tokens[pos + 1].type = 0;
-                ngx_conf_ccv_tokens_to_list(tokens, pos + 2, pos2 - 1);
+
+            if (token->type != T_ALPHA) {
+                op = NGX_CONF_CCV_CONST;
+
+            } else if (token->text.len == 1 && token->text.data[0] == '.') {
+                op = NGX_CONF_CCV_DOT;
+
             } else {
-                tokens[pos].type = T_ARPAR;
-                tokens[pos].n_ops = pos2 - pos;
+                op = NGX_CONF_CCV_VAR;
             }
-            /* pos does not increment, so our modified block will get reevaluated */
-            continue;
-        }
-        switch (tokens[pos].type) {
-            case 0:
-                /* Erased tokens are kept in place to avoid renumbering
-                 * all other tokens; just ignore it. */
-                continue;
-            case ')':
-                ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-                    ") without (");
-                return -1;
-            case ',':
-                prio = 10;
-                break;
-            default:
-                prio = 0;
+
+            if (ngx_conf_ccv_emit(ccv, expr, prog, op, token, 0, &depth)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+            operand = 0;
+            break;
+
+        case T_PAR:
+            if (!operand) {
+                goto unexpected;
+            }
+            stack[top].token = token;
+            stack[top].prio = 0;
+            stack[top].nargs = -1;
+            ++top;
+            break;
+
+        case T_OPER:
+            unary = token->text.len == 1 && token->text.data[0] == '!';
+            if (operand != unary) {
+                goto unexpected;
+            }
+
+            prio = ngx_conf_ccv_oper_prio(&token->text);
+
+            /* binary operators are left-associative: those as tight as
+             * this one are output first */
+            while (!unary && top && stack[top - 1].prio
+                   && stack[top - 1].prio <= prio)
+            {
+                --top;
+                if (ngx_conf_ccv_emit(ccv, expr, prog, NGX_CONF_CCV_OPER,
+                                      stack[top].token, stack[top].nargs,
+                                      &depth)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            stack[top].token = token;
+            stack[top].prio = prio;
+            stack[top].nargs = unary ? 1 : 2;
+            ++top;
+            operand = 1;
+            break;
+
+        case ',':
+        case ')':
+            if (operand) {
+                goto unexpected;
+            }
+
+            while (top && stack[top - 1].prio) {
+                --top;
+                if (ngx_conf_ccv_emit(ccv, expr, prog, NGX_CONF_CCV_OPER,
+                                      stack[top].token, stack[top].nargs,
+                                      &depth)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            if (top == 0
+                || (token->type == ',' && stack[top - 1].nargs < 0))
+            {
+                goto unexpected;
+            }
+
+            if (token->type == ',') {
+                ++stack[top - 1].nargs;
+                operand = 1;
                 break;
-        }
-        if (prio > prio_max) {
-            prio_max = prio;
-            pos_max = pos;
-        }
+            }
 
-        pos += tokens[pos].n_ops ? tokens[pos].n_ops : 1;
-    }
+            --top;
+            if (stack[top].nargs >= 0
+                && ngx_conf_ccv_emit(ccv, expr, prog, NGX_CONF_CCV_CALL,
+                                     stack[top].token, stack[top].nargs + 1,
+                                     &depth)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+            break;
 
-    if (pos < end) {
-        end = pos;
-    } else {
-        closer = 0;
+        default:
+            goto unexpected;
+        }
     }
 
-    /* empty contents */
-    if (prio_max < 0) {
-        return pos;
+    if (operand) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+            "cannot resolve {{ %V }}: missing operand at the end", expr);
+        return NGX_ERROR;
     }
 
-    if (prio_max == 0) {
-        if (tokens[pos_max].type == T_ALPHA)
-            tokens[pos_max].type = T_VAR;
-        if (!tokens[pos_max].n_ops)
-            tokens[pos_max].n_ops = 1;
-        return pos_max + tokens[pos_max].n_ops;
+    while (top) {
+        --top;
+        if (stack[top].prio == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                "cannot resolve {{ %V }}: missing closing parenthesis", expr);
+            return NGX_ERROR;
+        }
+        if (ngx_conf_ccv_emit(ccv, expr, prog, NGX_CONF_CCV_OPER,
+                              stack[top].token, stack[top].nargs, &depth)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
-    /* operators */
-    if (pos_max < end - 1) {
-        if ((pos2 = ngx_conf_ccv_order_tokens(ccv, tokens, pos_max + 1, end, closer)) < 0)
-            return pos2;
-    } else {
-        pos2 = end;
-    }
-    if (pos_max > start)
-        if ((pos = ngx_conf_ccv_order_tokens(ccv, tokens, start, pos_max, T_END)) < 0)
-            return pos;
-    /* @todo Ensure an operator has always exactly one operand at left and one at right. */
-    tokens[pos_max].n_ops = pos2 - start;
-    /* polish notation */
-    if (pos_max > start) {
-        token = tokens[pos_max];
-        memmove(&tokens[start + 1], &tokens[start], (pos_max - start) * sizeof(ngx_conf_ccv_token_t));
-        tokens[start] = token;
-    }
+    prog->codes[prog->n_codes].op = NGX_CONF_CCV_END;
+
+    return NGX_OK;
 
-    return pos2;
+unexpected:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+        "cannot resolve {{ %V }}: unexpected \"%V\" at position %d",
+        expr, &token->text, (int) (token->text.data - expr->data));
+    return NGX_ERROR;
 }
 
 
+/* Appends a code to prog, keeping count of the values it stacks. A variable
+ * gets its symbol, and a call is bound, then run right away if its function
+ * is pure and its arguments constant. */
+
 int
-ngx_conf_ccv_tokens_to_list(ngx_conf_ccv_token_t *tokens, int start,
-    int end)
+ngx_conf_ccv_emit(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_prog_t *prog, u_char op, ngx_conf_ccv_token_t *token,
+    int nargs, int *depth)
 {
-    int pos;
-    u_char comma_next = 1;
+    ngx_conf_ccv_code_t  *code;
 
-    for (pos = start; pos < end; /* void */ ) {
-        if (!tokens[pos].type)
-            continue;
-        if (comma_next) {
-            if (tokens[pos].type != ',') {
-                return -1;
-            }
-            tokens[pos].type = 0;
-            ++pos;
-        } else {
-            /* having a left-side of , then skipping to right-side */
-            pos += tokens[pos].n_ops;
+    code = &prog->codes[prog->n_codes++];
+    code->op = op;
+    code->nargs = nargs;
+    code->text = token->text;
+    code->func = NULL;
+    code->sym = NGX_DECLINED;
+    code->num.unit = NGX_CONF_CCV_TEXT;
+
+    *depth += 1 - nargs;
+    if (*depth > prog->depth) {
+        prog->depth = *depth;
+    }
+
+    switch (op) {
+
+    case NGX_CONF_CCV_CONST:
+        (void) ngx_conf_ccv_num(&code->text, &code->num);
+        break;
+
+    case NGX_CONF_CCV_VAR:
+        /* symbols live as long as the compiled expressions */
+        code->sym = ngx_conf_script_sym(ccv->ctx, &code->text, 1);
+        if (code->sym == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        break;
+
+    case NGX_CONF_CCV_CALL:
+        if (ngx_conf_ccv_bind_func(ccv, expr, code) != NGX_OK
+            || ngx_conf_ccv_fold_func(ccv, prog) != NGX_OK)
+        {
+            return NGX_ERROR;
         }
-        comma_next ^= 1;
+        break;
+
+    case NGX_CONF_CCV_OPER:
+        if (ngx_conf_ccv_fold_oper(ccv, prog) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        break;
     }
 
-    return 0;
+    return NGX_OK;
 }
 
 
+/* Length of the operator at p, 0 if there is none. */
+
 int
-ngx_conf_ccv_resolve_tokens(ngx_conf_ccv_t *ccv,
-    ngx_conf_ccv_token_t *tokens, int n_tokens, ngx_str_t *expr)
+ngx_conf_ccv_oper_len(u_char *p, u_char *last)
 {
-    ngx_str_t *res = (ngx_str_t *)alloca(n_tokens * sizeof(ngx_str_t));
-    int *from = (int *)alloca(n_tokens * sizeof(int));
-    int *to = (int *)alloca(n_tokens * sizeof(int));
-    int posr, post, end;
-    int r;
-
-    for (post = posr = n_tokens; --post >= 0; /* void */ ) {
-        if (!tokens[post].type)
-            continue;
-        --posr;
-        from[posr] = post;
-        to[posr] = post + tokens[post].n_ops - 1;
-        switch (tokens[post].type) {
-            case T_VAR:
-                res[posr] = tokens[post].text;
-                if ((r = ngx_conf_ccv_resolve_var(ccv, &res[posr])) == NGX_ERROR)
-                    return r;
-                break;
-            case T_FUNC:
-                /* args are everything whose end is included in the function's end */
-                for (end = posr; ++end < n_tokens && to[end] <= to[posr]; /* void */)
-                { /* void */ }
-                res[posr] = tokens[post].text;
-                if ((r = ngx_conf_ccv_resolve_func(ccv, end - posr, &res[posr])) == NGX_ERROR)
-                    return r;
-                if (--end > posr) {
-                    res[end] = res[posr];
-                    posr = end;
-                }
-                break;
-            case 0:
-                break;
-            default:
-                ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-                    "unexpected token of type %c in {{ %V }}", tokens[post].type, expr);
-                return NGX_ERROR;
-        }
+    if (p + 1 < last
+        && ((p[1] == '=' && (p[0] == '=' || p[0] == '!' || p[0] == '<'
+                             || p[0] == '>'))
+            || (p[0] == '&' && p[1] == '&')
+            || (p[0] == '|' && p[1] == '|')))
+    {
+        return 2;
     }
 
-    /* @todo? return tail instead of head, in case of a multi-string
-     * return, e.g. in << A = <complex compute>, A == "0" ? "" : A >>
-     * we want the final evaluation */
-    *expr = res[posr];
+    switch (p[0]) {
 
-    return NGX_OK;
+    case '<':
+    case '>':
+    case '!':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+        return 1;
+
+    default:
+        return 0;
+    }
 }
 
 
+/* The loosest binding splits an expression first. */
+
 int
-ngx_conf_ccv_resolve_var(ngx_conf_ccv_t *ccv, ngx_str_t *expr)
+ngx_conf_ccv_oper_prio(ngx_str_t *oper)
 {
-    if (expr->len == 1 && ngx_strncmp(expr->data, ".", 1) == 0) {
-    	expr->len = ccv->cf->conf_file->file.name.len;
-    	expr->data = ccv->cf->conf_file->file.name.data;
-        for (expr->len = ccv->cf->conf_file->file.name.len;
-             expr->data[--expr->len] != '/';
-             /* void */ )
-        { /* void */ }
-    	return NGX_OK;
-    } else {
-        ngx_conf_script_vars_t *vars;
-        ngx_str_t              *val;
-        for (vars = ccv->cf->vars; vars; vars = vars->next) {
-            val = ngx_conf_script_var_find(vars, expr);
-            if (val) {
-                expr->data = val->data;
-                expr->len = val->len;
-                return NGX_OK;
-            }
-        }
-        /* TODO: if not found, return the original string (it maybe a string
-         * that coincidentally used our delimiter. Make it parametrizable:
-         * silent, warn, error */
-    	ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-    		"not implemented: cannot resolve {{ %V }}", expr);
-    	return NGX_ERROR;
+    switch (oper->data[0]) {
+
+    case '|':
+        return 9;
+
+    case '&':
+        return 8;
+
+    case '+':
+    case '-':
+        return 5;
+
+    case '*':
+    case '/':
+    case '%':
+        return 4;
+
+    case '!':
+        return oper->len == 1 ? 3 : 7;
+
+    default:
+        return 7;
     }
 }
 
 
+/* Runs prog on a stack of values, on ours unless it is deep. A call or an
+ * operator finds its arguments at the top, and is lent the slot below them
+ * for argv[0], its name then its result (the stack has one more slot at the
+ * bottom for that). Along with its text, each value has its number once
+ * known, so that operators pass numbers to each other as they are. */
+
 int
-ngx_conf_ccv_resolve_func(ngx_conf_ccv_t *ccv, int argc, ngx_str_t *argv)
+ngx_conf_ccv_exec(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog,
+    ngx_str_t *expr)
 {
-    int i;
+    ngx_str_t              local[NGX_CONF_CCV_STACK], *stack, *sp, *argv;
+    ngx_str_t              below;
+    ngx_conf_ccv_code_t   *code;
+    ngx_conf_script_num_t  nlocal[NGX_CONF_CCV_STACK], *nums, *np, nbelow;
+
+#if (NGX_CONF_CCV_THREADED)
+    static void           *dispatch[] = {
+        &&op_END, &&op_CONST, &&op_VAR, &&op_DOT, &&op_CALL, &&op_OPER
+    };
+
+#define ngx_conf_ccv_op(op)  op_##op
+#define ngx_conf_ccv_next()  goto *dispatch[(++code)->op]
+#else
+#define ngx_conf_ccv_op(op)  case NGX_CONF_CCV_##op
+#define ngx_conf_ccv_next()  ++code; continue
+#endif
 
-    for (i = -1; ngx_conf_script_functions[++i].func; /* void */ ) {
-        if (ngx_strcmp(&ngx_conf_script_functions[i].name, &argv[0]) == 0) {
-            argv[0] = ngx_conf_script_functions[i].func(argc - 1, &argv[1]);
-            return argv[0].data ? NGX_OK : NGX_ERROR;
+    stack = local;
+    nums = nlocal;
+    if (prog->depth >= NGX_CONF_CCV_STACK) {
+        /* released along with the rest of ccv's scratch */
+        stack = ngx_conf_script_alloc(ccv->ctx,
+                                      (prog->depth + 1)
+                                      * (sizeof(ngx_str_t)
+                                         + sizeof(ngx_conf_script_num_t)));
+        if (stack == NULL) {
+            return NGX_ERROR;
         }
+        nums = (ngx_conf_script_num_t *) &stack[prog->depth + 1];
     }
+    sp = &stack[1];
+    np = &nums[1];
 
-    ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
-        "no config script function named %V()", &argv[0]);
-    return NGX_ERROR;
-}
+    code = prog->codes;
 
-int
-ngx_conf_script_var_set(ngx_conf_script_vars_t *vars, ngx_str_t *name,
-    ngx_str_t *val)
-{
-    ngx_int_t              pos;
-    ngx_conf_script_var_t *var;
-    pos = ngx_conf_script_var_pos(vars, name);
-    if (pos < 0) {
-        pos = -1 - pos;
-        var = (ngx_conf_script_var_t *)ngx_array_push(&vars->vars);
-        if (!var) {
+#if (NGX_CONF_CCV_THREADED)
+    goto *dispatch[code->op];
+#else
+    for ( ;; ) {
+    switch (code->op) {
+#endif
+
+    ngx_conf_ccv_op(CONST):
+        *sp++ = code->text;
+        *np++ = code->num;
+        ngx_conf_ccv_next();
+
+    ngx_conf_ccv_op(VAR):
+        if (ngx_conf_ccv_resolve_var(ccv, code, sp) == NGX_ERROR) {
             return NGX_ERROR;
         }
-        if (pos < vars->vars.nelts - 1) {
-            var = &ngx_array_get(ngx_conf_script_var_t, &vars->vars, pos);
-            ngx_memcpy(
-                &var[1],
-                var,
-                (vars->vars.nelts - 1 - pos) * sizeof(ngx_conf_script_var_t));
+        ++sp;
+        (np++)->unit = NGX_CONF_CCV_TEXT;
+        ngx_conf_ccv_next();
+
+    ngx_conf_ccv_op(DOT):
+        ngx_conf_ccv_resolve_dot(ccv, sp++);
+        (np++)->unit = NGX_CONF_CCV_TEXT;
+        ngx_conf_ccv_next();
+
+    ngx_conf_ccv_op(CALL):
+        sp -= code->nargs;
+        np -= code->nargs;
+        argv = sp - 1;
+        below = *argv;
+        *argv = code->text;
+        if (ngx_conf_ccv_resolve_func(ccv, code->func, code->nargs + 1, argv)
+            == NGX_ERROR)
+        {
+            return NGX_ERROR;
         }
-    } else {
-        var = &ngx_array_get(ngx_conf_script_var_t, &vars->vars, pos);
+        *sp++ = *argv;
+        *argv = below;
+        (np++)->unit = NGX_CONF_CCV_TEXT;
+        ngx_conf_ccv_next();
+
+    ngx_conf_ccv_op(OPER):
+        sp -= code->nargs;
+        np -= code->nargs;
+        argv = sp - 1;
+        below = *argv;
+        nbelow = np[-1];
+        *argv = code->text;
+        if (ngx_conf_ccv_resolve_oper(ccv, code->nargs + 1, argv, np - 1)
+            == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+        *sp++ = *argv;
+        *argv = below;
+        *np = np[-1];
+        np[-1] = nbelow;
+        ++np;
+        ngx_conf_ccv_next();
+
+    ngx_conf_ccv_op(END):
+        *expr = sp[-1];
+        return NGX_OK;
+
+#if !(NGX_CONF_CCV_THREADED)
     }
-    var->name.data = name->data;
-    var->name.len = name->len;
-    var->val.data = val->data;
-    var->val.len = val->len;
+    }
+#endif
 
-    return NGX_OK;
+#undef ngx_conf_ccv_op
+#undef ngx_conf_ccv_next
 }
 
 
-ngx_str_t *
-ngx_conf_script_var_find(ngx_conf_script_vars_t *vars, ngx_str_t *name)
+/* Replaces argv[0], an operator, with its value from argv[1] to
+ * argv[argc - 1], and nums[0] with its number. Comparisons are numeric
+ * between numbers (of the same kind of unit), and byte-wise otherwise;
+ * results are 1 or 0. && and || do not short-circuit: both sides have
+ * been evaluated by the time they get here. */
+
+int
+ngx_conf_ccv_resolve_oper(ngx_conf_ccv_t *ccv, int argc, ngx_str_t *argv,
+    ngx_conf_script_num_t *nums)
 {
-    ngx_int_t pos;
-    pos = ngx_conf_script_var_pos(vars, name);
-    return pos >= 0 ? &(ngx_array_get(ngx_conf_script_var_t, &vars->vars, pos).val) : NULL;
-}
+    static ngx_str_t  bools[] = { ngx_string("0"), ngx_string("1") };
 
+    u_char                 op;
+    size_t                 len;
+    ngx_int_t              cmp;
+    ngx_conf_script_num_t  a, b;
 
-ngx_int_t
-ngx_conf_script_var_pos(ngx_conf_script_vars_t *vars, ngx_str_t *name)
-{
-    /* As conf_script vars are not expected to be numerous, we do a
-     * simple dichotomy instead of a full hash. */
-    ngx_int_t start, middle, end;
-    ngx_str_t * comp;
-    ngx_int_t str_comp_res, length_comp_res;
-    for (start = 0, end = vars->vars.nelts; end > start;) {
-        middle = (start + end) / 2;
-        comp = &(ngx_array_get(ngx_conf_script_var_t, &vars->vars, middle).name);
-        length_comp_res = name->len - comp->len;
-        str_comp_res = ngx_strncmp(name->data, comp->data, length_comp_res >= 0 ? comp->len : name->len);
-        if (str_comp_res == 0) {
-            if (length_comp_res == 0) {
-                return middle;
-            }
-            str_comp_res += length_comp_res;
-        }
-        if (str_comp_res < 0) {
-            start = middle + 1;
-        } else {
-            end = middle;
+    op = argv[0].data[0];
+
+    switch (op) {
+
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+        return ngx_conf_ccv_resolve_arith(ccv, argv, nums);
+
+    case '&':
+        cmp = ngx_conf_script_true(&argv[1])
+              && ngx_conf_script_true(&argv[2]);
+        goto done;
+
+    case '|':
+        cmp = ngx_conf_script_true(&argv[1])
+              || ngx_conf_script_true(&argv[2]);
+        goto done;
+    }
+
+    if (argv[0].len == 1 && op == '!') {
+        cmp = !ngx_conf_script_true(&argv[1]);
+        goto done;
+    }
+
+    a = nums[1];
+    b = nums[2];
+
+    if (ngx_conf_ccv_num(&argv[1], &a) == NGX_OK
+        && ngx_conf_ccv_num(&argv[2], &b) == NGX_OK
+        && ngx_conf_script_num_unify(&a, &b) == NGX_OK)
+    {
+        cmp = (a.value > b.value) - (a.value < b.value);
+
+    } else {
+        len = ngx_min(argv[1].len, argv[2].len);
+        cmp = ngx_memcmp(argv[1].data, argv[2].data, len);
+        if (cmp == 0) {
+            cmp = (argv[1].len > argv[2].len) - (argv[1].len < argv[2].len);
         }
     }
-    return -1 - start;
-}
 
+    switch (op) {
 
-void
-ngx_conf_script_block_start(ngx_conf_t *cf)
-{
-    ++cf->cycle->conf_block_level;
+    case '=':
+        cmp = (cmp == 0);
+        break;
+
+    case '!':
+        cmp = (cmp != 0);
+        break;
+
+    case '<':
+        cmp = argv[0].len == 2 ? (cmp <= 0) : (cmp < 0);
+        break;
+
+    default: /* '>' */
+        cmp = argv[0].len == 2 ? (cmp >= 0) : (cmp > 0);
+        break;
+    }
+
+done:
+
+    argv[0] = bools[cmp];
+    nums[0].value = cmp;
+    nums[0].unit = NGX_CONF_SCRIPT_NUM;
+
+    return NGX_OK;
 }
 
 
-void
-ngx_conf_script_block_done(ngx_conf_t *cf)
+/* Replaces argv[0], an arithmetic operator, with its result on argv[1]
+ * and argv[2], and nums[0] with its number. A unit multiplies or divides by
+ * a unitless number, adds to the same kind of unit, and divides by it into
+ * a unitless ratio. */
+
+int
+ngx_conf_ccv_resolve_arith(ngx_conf_ccv_t *ccv, ngx_str_t *argv,
+    ngx_conf_script_num_t *nums)
 {
-    ngx_conf_script_vars_t *vars;
+    u_char                 op;
+    ngx_int_t              n;
+    ngx_conf_script_num_t  a, b;
 
-    --cf->cycle->conf_block_level;
-    while (cf->vars && cf->vars->block_level > cf->cycle->conf_block_level) {
-        vars = cf->vars;
+    op = argv[0].data[0];
+
+    for (n = 1; n <= 2; ++n) {
+        if (ngx_conf_ccv_num(&argv[n], &nums[n]) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                               "\"%V\" is not a number, in %V",
+                               &argv[n], &argv[0]);
+            return NGX_ERROR;
+        }
+    }
+
+    a = nums[1];
+    b = nums[2];
+
+    if (op == '*' || ((op == '/' || op == '%') && b.unit == NGX_CONF_SCRIPT_NUM))
+    {
+        if (a.unit != NGX_CONF_SCRIPT_NUM && b.unit != NGX_CONF_SCRIPT_NUM) {
+            ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                               "cannot multiply \"%V\" by \"%V\"",
+                               &argv[1], &argv[2]);
+            return NGX_ERROR;
+        }
+
+        if (a.unit == NGX_CONF_SCRIPT_NUM) {
+            a.unit = b.unit;
+        }
+
+    } else if (ngx_conf_script_num_unify(&a, &b) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                           "cannot %s \"%V\" and \"%V\": different units, "
+                           "or an m that can be minutes or megabytes",
+                           op == '+' ? "add" : op == '-' ? "subtract"
+                                                         : "divide",
+                           &argv[1], &argv[2]);
+        return NGX_ERROR;
+
+    } else if (op == '/') {
+        /* a ratio */
+        a.unit = NGX_CONF_SCRIPT_NUM;
+    }
+
+    if ((op == '/' || op == '%') && b.value == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                           "division by zero: \"%V\" %V \"%V\"",
+                           &argv[1], &argv[0], &argv[2]);
+        return NGX_ERROR;
+    }
+
+    /* 3m / 2 is 1536k, or 90s: only exact divisions keep the m */
+    if (a.unit == NGX_CONF_SCRIPT_M && b.unit == NGX_CONF_SCRIPT_NUM
+        && (op == '%' || (op == '/' && a.value % b.value != 0)))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                           "\"%V\" %V \"%V\" depends on whether m is "
+                           "megabytes or minutes, write M or s instead",
+                           &argv[1], &argv[0], &argv[2]);
+        return NGX_ERROR;
+    }
+
+    /* away from a time, an M is megabytes: 1M / 2 is 512k */
+    if (a.unit == NGX_CONF_SCRIPT_MM && b.unit == NGX_CONF_SCRIPT_NUM
+        && (op == '%' || (op == '/' && a.value % b.value != 0)))
+    {
+        if (ngx_abs(a.value) > NGX_MAX_INT_T_VALUE / (1024 * 1024)) {
+            goto overflow;
+        }
+        a.value *= 1024 * 1024;
+        a.unit = NGX_CONF_SCRIPT_SIZE;
+    }
+
+    switch (op) {
+
+    case '-':
+        b.value = -b.value;
+        /* fall through */
+
+    case '+':
+        if ((b.value > 0 && a.value > NGX_MAX_INT_T_VALUE - b.value)
+            || (b.value < 0 && a.value < -NGX_MAX_INT_T_VALUE - b.value))
+        {
+            goto overflow;
+        }
+        a.value += b.value;
+        break;
+
+    case '*':
+        if (b.value != 0
+            && ngx_abs(a.value) > NGX_MAX_INT_T_VALUE / ngx_abs(b.value))
+        {
+            goto overflow;
+        }
+        a.value *= b.value;
+        break;
+
+    case '/':
+        a.value /= b.value;
+        break;
+
+    default: /* '%' */
+        a.value %= b.value;
+        break;
+    }
+
+    argv[0].data = ngx_conf_script_alloc(ccv->ctx, NGX_CONF_SCRIPT_NUM_LEN);
+    if (argv[0].data == NULL) {
+        return NGX_ERROR;
+    }
+
+    argv[0].len = ngx_conf_script_num_format(argv[0].data, &a)
+                  - argv[0].data;
+    nums[0] = a;
+
+    return NGX_OK;
+
+overflow:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                       "overflow in \"%V\" %V \"%V\"",
+                       &argv[1], &argv[0], &argv[2]);
+    return NGX_ERROR;
+}
+
+
+/* Gives val's number in num, reading it from val unless num already has it
+ * (as an operator's result or a constant does). */
+
+ngx_int_t
+ngx_conf_ccv_num(ngx_str_t *val, ngx_conf_script_num_t *num)
+{
+    ngx_conf_script_num_t  n;
+
+    if (num->unit != NGX_CONF_CCV_TEXT) {
+        return NGX_OK;
+    }
+
+    if (ngx_conf_script_num(val, &n) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    *num = n;
+
+    return NGX_OK;
+}
+
+
+/* Parses a number with an optional unit: k or g for sizes (in bytes), ms,
+ * s, h, d, w or y for times (in milliseconds), m (megabytes or minutes) and
+ * M (megabytes or months) until they meet another unit. */
+
+ngx_int_t
+ngx_conf_script_num(ngx_str_t *s, ngx_conf_script_num_t *num)
+{
+    u_char      *p, *last;
+    ngx_int_t    n, scale;
+    ngx_uint_t   neg;
+
+    p = s->data;
+    last = p + s->len;
+
+    neg = (p < last && *p == '-');
+    p += neg;
+
+    if (p == last || *p < '0' || *p > '9') {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; p < last && *p >= '0' && *p <= '9'; ++p) {
+        if (n > (NGX_MAX_INT_T_VALUE - (*p - '0')) / 10) {
+            return NGX_ERROR;
+        }
+        n = n * 10 + (*p - '0');
+    }
+
+    num->unit = NGX_CONF_SCRIPT_TIME;
+
+    switch (last - p) {
+
+    case 0:
+        num->unit = NGX_CONF_SCRIPT_NUM;
+        scale = 1;
+        break;
+
+    case 1:
+        switch (*p) {
+        case 'k':
+        case 'K':
+            num->unit = NGX_CONF_SCRIPT_SIZE;
+            scale = 1024;
+            break;
+        case 'M':
+            num->unit = NGX_CONF_SCRIPT_MM;
+            scale = 1;
+            break;
+        case 'g':
+        case 'G':
+            num->unit = NGX_CONF_SCRIPT_SIZE;
+            scale = 1024 * 1024 * 1024;
+            break;
+        case 'm':
+            num->unit = NGX_CONF_SCRIPT_M;
+            scale = 1;
+            break;
+        case 's':
+            scale = 1000;
+            break;
+        case 'h':
+            scale = 60 * 60 * 1000;
+            break;
+        case 'd':
+            scale = 24 * 60 * 60 * 1000;
+            break;
+        case 'w':
+            scale = (ngx_int_t) 7 * 24 * 60 * 60 * 1000;
+            break;
+        case 'y':
+            scale = (ngx_int_t) 365 * 24 * 60 * 60 * 1000;
+            break;
+        default:
+            return NGX_ERROR;
+        }
+        break;
+
+    case 2:
+        if (p[0] != 'm' || p[1] != 's') {
+            return NGX_ERROR;
+        }
+        scale = 1;
+        break;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    if (n > NGX_MAX_INT_T_VALUE / scale) {
+        return NGX_ERROR;
+    }
+
+    num->value = neg ? -n * scale : n * scale;
+
+    return NGX_OK;
+}
+
+
+/* Brings a and b to the same unit: next to a size or a time, a unitless
+ * number is bytes or seconds, and an m megabytes or minutes. An M is
+ * months (30 days) next to a time, as ngx_parse_time() reads it, and
+ * megabytes otherwise. */
+
+ngx_int_t
+ngx_conf_script_num_unify(ngx_conf_script_num_t *a, ngx_conf_script_num_t *b)
+{
+    ngx_int_t               scale;
+    ngx_conf_script_num_t  *from, *to;
+
+    if (a->unit == b->unit) {
+        return NGX_OK;
+    }
+
+    if ((a->unit == NGX_CONF_SCRIPT_MM && b->unit == NGX_CONF_SCRIPT_NUM)
+        || (b->unit == NGX_CONF_SCRIPT_MM && a->unit == NGX_CONF_SCRIPT_NUM))
+    {
+        from = a->unit == NGX_CONF_SCRIPT_MM ? a : b;
+
+        if (ngx_abs(from->value) > NGX_MAX_INT_T_VALUE / (1024 * 1024)) {
+            return NGX_DECLINED;
+        }
+
+        from->value *= 1024 * 1024;
+        from->unit = NGX_CONF_SCRIPT_SIZE;
+
+        return NGX_OK;
+    }
+
+    if (a->unit == NGX_CONF_SCRIPT_SIZE || a->unit == NGX_CONF_SCRIPT_TIME) {
+        from = b;
+        to = a;
+
+    } else {
+        from = a;
+        to = b;
+    }
+
+    switch (to->unit) {
+
+    case NGX_CONF_SCRIPT_SIZE:
+        if (from->unit == NGX_CONF_SCRIPT_TIME) {
+            return NGX_DECLINED;
+        }
+        scale = (from->unit == NGX_CONF_SCRIPT_M
+                 || from->unit == NGX_CONF_SCRIPT_MM) ? 1024 * 1024 : 1;
+        break;
+
+    case NGX_CONF_SCRIPT_TIME:
+        if (from->unit == NGX_CONF_SCRIPT_SIZE) {
+            return NGX_DECLINED;
+        }
+        scale = from->unit == NGX_CONF_SCRIPT_M ? 60 * 1000
+                : from->unit == NGX_CONF_SCRIPT_MM
+                  ? (ngx_int_t) 30 * 24 * 60 * 60 * 1000 : 1000;
+        break;
+
+    default:
+        /* an m, and a unitless number or an M */
+        return NGX_DECLINED;
+    }
+
+    if (ngx_abs(from->value) > NGX_MAX_INT_T_VALUE / scale) {
+        return NGX_DECLINED;
+    }
+
+    from->value *= scale;
+    from->unit = to->unit;
+
+    return NGX_OK;
+}
+
+
+/* Prints num in the largest unit it is a whole number of, as
+ * ngx_conf_script_num() reads it back: megabytes as M, and a time never in
+ * m or M, which could be sizes. p has NGX_CONF_SCRIPT_NUM_LEN bytes. */
+
+u_char *
+ngx_conf_script_num_format(u_char *p, ngx_conf_script_num_t *num)
+{
+    ngx_uint_t  i;
+
+    static struct {
+        ngx_int_t   scale;
+        char       *unit;
+    } sizes[] = {
+        { 1024 * 1024 * 1024, "g" },
+        { 1024 * 1024, "M" },
+        { 1024, "k" },
+        { 1, "" }
+    }, times[] = {
+        { 24 * 60 * 60 * 1000, "d" },
+        { 60 * 60 * 1000, "h" },
+        { 1000, "s" },
+        { 1, "ms" }
+    };
+
+    switch (num->unit) {
+
+    case NGX_CONF_SCRIPT_SIZE:
+        for (i = 0; num->value % sizes[i].scale; ++i) { /* void */ }
+        return ngx_sprintf(p, "%i%s", num->value / sizes[i].scale,
+                           num->value ? sizes[i].unit : "");
+
+    case NGX_CONF_SCRIPT_TIME:
+        for (i = 0; num->value % times[i].scale; ++i) { /* void */ }
+        return ngx_sprintf(p, "%i%s", num->value / times[i].scale,
+                           num->value ? times[i].unit : "");
+
+    case NGX_CONF_SCRIPT_M:
+        return ngx_sprintf(p, "%im", num->value);
+
+    case NGX_CONF_SCRIPT_MM:
+        return ngx_sprintf(p, "%iM", num->value);
+
+    default:
+        return ngx_sprintf(p, "%i", num->value);
+    }
+}
+
+
+/* An empty or "0" value is false. */
+
+ngx_uint_t
+ngx_conf_script_true(ngx_str_t *value)
+{
+    return value->len > 1 || (value->len == 1 && value->data[0] != '0');
+}
+
+
+int
+ngx_conf_ccv_resolve_var(ngx_conf_ccv_t *ccv, ngx_conf_ccv_code_t *code,
+    ngx_str_t *val)
+{
+    int  rc;
+
+    rc = ngx_conf_ccv_lookup_sym(ccv, code->sym, val);
+
+    if (rc == NGX_DECLINED) {
+        /* TODO: if not found, return the original string (it maybe a string
+         * that coincidentally used our delimiter. Make it parametrizable:
+         * silent, warn, error */
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+            "not implemented: cannot resolve {{ %V }}", &code->text);
+        return NGX_ERROR;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ccv->ctx->define) {
+        return ngx_conf_script_dep_add(&ccv->ctx->define->deps, &code->text,
+                                       val);
+    }
+
+    if (ccv->ctx->recording) {
+        return ngx_conf_script_dep_add(&ccv->ctx->deps, &code->text, val);
+    }
+
+    return NGX_OK;
+}
+
+
+/* Finds the value of a variable, by name or by symbol, NGX_DECLINED if it is
+ * not set. */
+
+int
+ngx_conf_ccv_lookup_var(ngx_conf_ccv_t *ccv, ngx_str_t *name,
+    ngx_str_t *val)
+{
+    ngx_int_t  sym;
+
+    sym = ngx_conf_script_sym(ccv->ctx, name, 0);
+    if (sym == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return ngx_conf_ccv_lookup_sym(ccv, sym, val);
+}
+
+
+int
+ngx_conf_ccv_lookup_sym(ngx_conf_ccv_t *ccv, ngx_int_t sym, ngx_str_t *val)
+{
+    ngx_conf_script_var_t  *var;
+    ngx_uint_t              depth;
+
+    ++ccv->ctx->total.lookups;
+    if (sym < 0 || ccv->cf->vars == NULL) {
+        return NGX_DECLINED;
+    }
+
+    var = ngx_conf_script_var_find(ccv->cf->vars, sym, &depth);
+    ccv->ctx->total.depth += depth;
+    if (depth > ccv->ctx->total.max_depth) {
+        ccv->ctx->total.max_depth = depth;
+    }
+    if (var == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (var->define) {
+        return ngx_conf_ccv_expand_define(ccv, var, val);
+    }
+    val->data = var->val.data;
+    val->len = var->val.len;
+
+    return NGX_OK;
+}
+
+
+/* Expands a define where it gets referenced, with the marks and . of where
+ * it was defined. The last expansion is reused as long as the variables it
+ * read have the same values where the define is referenced again. */
+
+int
+ngx_conf_ccv_expand_define(ngx_conf_ccv_t *ccv, ngx_conf_script_var_t *var,
+    ngx_str_t *val)
+{
+    int                        rc;
+    ngx_conf_script_ctx_t     *ctx;
+    ngx_conf_script_delim_t   *delim;
+    ngx_conf_script_define_t  *def;
+
+    ctx = ccv->ctx;
+    def = var->define;
+
+    if (def->busy) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+                           "recursive definition of {{ %V }}", &var->name);
+        return NGX_ERROR;
+    }
+
+    if (def->expanded) {
+        rc = ngx_conf_ccv_define_valid(ccv, def);
+        if (rc != NGX_DECLINED) {
+            *val = def->result;
+            return rc;
+        }
+    }
+
+    delim = ccv->cf->conf_file->script_delim;
+
+    def->busy = 1;
+    def->expanded = 0;
+    def->deps.nelts = 0;
+    def->prev = ctx->define;
+    ctx->define = def;
+    ccv->cf->conf_file->script_delim = &def->delim;
+
+    *val = def->value;
+    rc = ngx_conf_complex_value_shared(ccv->cf, val);
+
+    ccv->cf->conf_file->script_delim = delim;
+    ctx->define = def->prev;
+    def->busy = 0;
+
+    if (rc == NGX_OK) {
+        def->result = *val;
+        def->expanded = 1;
+    }
+
+    return rc;
+}
+
+
+/* Tells if the variables def's last expansion read still have the values it
+ * read, NGX_DECLINED if not. */
+
+int
+ngx_conf_ccv_define_valid(ngx_conf_ccv_t *ccv, ngx_conf_script_define_t *def)
+{
+    int                     rc;
+    ngx_str_t               val;
+    ngx_uint_t              i;
+    ngx_conf_script_dep_t  *deps;
+
+    def->busy = 1;
+    rc = NGX_OK;
+
+    deps = def->deps.elts;
+    for (i = 0; i < def->deps.nelts; ++i) {
+        rc = ngx_conf_ccv_lookup_var(ccv, &deps[i].name, &val);
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        if (val.len != deps[i].val.len
+            || ngx_memcmp(val.data, deps[i].val.data, val.len) != 0)
+        {
+            rc = NGX_DECLINED;
+            break;
+        }
+    }
+
+    def->busy = 0;
+
+    return i == def->deps.nelts ? NGX_OK : rc;
+}
+
+
+/* ., computed once per file by ngx_conf_script_file_start() when the core
+ * is patched to call it. */
+
+void
+ngx_conf_ccv_resolve_dot(ngx_conf_ccv_t *ccv, ngx_str_t *val)
+{
+    static ngx_str_t  dot = ngx_string(".");
+
+    if (ccv->ctx->define) {
+        *val = ccv->ctx->define->dir;
+        return;
+    }
+
+    ngx_conf_script_dir(ccv->cf, val);
+
+    if (ccv->ctx->recording
+        && ngx_conf_script_dep_add(&ccv->ctx->deps, &dot, val) != NGX_OK)
+    {
+        /* forget about keeping this expansion */
+        ccv->ctx->volatile_ = 1;
+    }
+}
+
+
+void
+ngx_conf_script_dir(ngx_conf_t *cf, ngx_str_t *dir)
+{
+    ngx_conf_script_file_t  *file;
+
+    file = cf->cycle->conf_script ? cf->cycle->conf_script->file : NULL;
+    if (file && file->conf_file == cf->conf_file) {
+        *dir = file->dir;
+        return;
+    }
+
+    ngx_conf_script_file_dir(&cf->conf_file->file.name, dir);
+}
+
+
+void
+ngx_conf_script_file_dir(ngx_str_t *name, ngx_str_t *dir)
+{
+    dir->data = name->data;
+    for (dir->len = name->len; dir->len > 0 && name->data[--dir->len] != '/';
+         /* void */ )
+    { /* void */ }
+}
+
+
+/* Looks up the function called at pos, and checks it gets as many arguments
+ * as it takes: the subtrees left between its parenthesis once the commas
+ * have been erased. */
+
+int
+ngx_conf_ccv_bind_func(ngx_conf_ccv_t *ccv, ngx_str_t *expr,
+    ngx_conf_ccv_code_t *code)
+{
+    int                          nargs;
+    ngx_uint_t                   type;
+    ngx_str_t                   *name;
+    ngx_conf_script_func_t      *func;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    name = &code->text;
+
+    elt = ngx_conf_script_hash_find(&ccv->ctx->funcs,
+                                    ngx_hash_key(name->data, name->len),
+                                    name->data, name->len);
+    if (elt == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+            "no config script function named %V()", name);
+        return NGX_ERROR;
+    }
+    func = elt->value;
+
+    nargs = code->nargs;
+
+    type = func->type;
+    if (!(type & NGX_CONF_ANY)
+        && !((type & NGX_CONF_1MORE) && nargs >= 1)
+        && !((type & NGX_CONF_2MORE) && nargs >= 2)
+        && !(nargs < 8 && (type & argument_number[nargs])))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, ccv->cf, 0,
+            "invalid number of arguments to %V() in {{ %V }}", name, expr);
+        return NGX_ERROR;
+    }
+
+    code->func = func;
+
+    return NGX_OK;
+}
+
+
+/* Runs a pure function whose arguments are all constants right away, and
+ * turns its call into a constant. */
+
+int
+ngx_conf_ccv_fold_func(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog)
+{
+    int                   i, nargs;
+    ngx_str_t            *argv;
+    ngx_conf_ccv_code_t  *code, *args;
+
+    code = &prog->codes[prog->n_codes - 1];
+
+    if (!(code->func->type & NGX_CONF_SCRIPT_PURE)) {
+        return NGX_OK;
+    }
+
+    /* a constant argument is a single code */
+    nargs = code->nargs;
+    args = code - nargs;
+    for (i = 0; i < nargs; ++i) {
+        if (args[i].op != NGX_CONF_CCV_CONST) {
+            return NGX_OK;
+        }
+    }
+
+    argv = ngx_conf_script_alloc(ccv->ctx, (nargs + 1) * sizeof(ngx_str_t));
+    if (argv == NULL) {
+        return NGX_ERROR;
+    }
+
+    argv[0] = code->text;
+    for (i = 0; i < nargs; ++i) {
+        argv[i + 1] = args[i].text;
+    }
+
+    /* memoized, thus in ctx->pool, where the cached program can refer to
+     * it */
+    if (ngx_conf_ccv_resolve_func(ccv, code->func, nargs + 1, argv)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    args[0].op = NGX_CONF_CCV_CONST;
+    args[0].nargs = 0;
+    args[0].text = argv[0];
+    args[0].func = NULL;
+    args[0].num.unit = NGX_CONF_CCV_TEXT;
+    (void) ngx_conf_ccv_num(&args[0].text, &args[0].num);
+    prog->n_codes -= nargs;
+
+    return NGX_OK;
+}
+
+
+/* Computes an operator whose operands are all constants right away, and
+ * turns it into a constant: 2 * 1024 is 2048 before any expansion. */
+
+int
+ngx_conf_ccv_fold_oper(ngx_conf_ccv_t *ccv, ngx_conf_ccv_prog_t *prog)
+{
+    int                    i, nargs;
+    u_char                *p;
+    ngx_str_t              argv[3];
+    ngx_conf_ccv_code_t   *code, *args;
+    ngx_conf_script_num_t  nums[3];
+
+    code = &prog->codes[prog->n_codes - 1];
+
+    nargs = code->nargs;
+    args = code - nargs;
+    for (i = 0; i < nargs; ++i) {
+        if (args[i].op != NGX_CONF_CCV_CONST) {
+            return NGX_OK;
+        }
+    }
+
+    argv[0] = code->text;
+    for (i = 0; i < nargs; ++i) {
+        argv[i + 1] = args[i].text;
+        nums[i + 1] = args[i].num;
+    }
+
+    if (ngx_conf_ccv_resolve_oper(ccv, nargs + 1, argv, nums) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    /* out of the scratch arena, for the cached program to refer to it */
+    p = ngx_pnalloc(ccv->ctx->pool, argv[0].len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memcpy(p, argv[0].data, argv[0].len);
+
+    args[0].op = NGX_CONF_CCV_CONST;
+    args[0].nargs = 0;
+    args[0].text.data = p;
+    args[0].text.len = argv[0].len;
+    args[0].func = NULL;
+    args[0].num = nums[0];
+    prog->n_codes -= nargs;
+
+    return NGX_OK;
+}
+
+
+/* Calls func on argv[1] to argv[argc - 1], replacing argv[0] (its name) with
+ * the result. Pure functions are run once per distinct arguments. */
+
+int
+ngx_conf_ccv_resolve_func(ngx_conf_ccv_t *ccv, ngx_conf_script_func_t *func,
+    int argc, ngx_str_t *argv)
+{
+    int                          i;
+    u_char                      *key, *p;
+    size_t                       len;
+    ngx_uint_t                   hash;
+    ngx_str_t                   *val;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    ctx = ccv->ctx;
+
+    if (!(func->type & NGX_CONF_SCRIPT_PURE)) {
+        /* nothing tells the next load it would return the same */
+        ctx->volatile_ = 1;
+        argv[0] = func->func(ccv->cf, argc - 1, &argv[1]);
+        return argv[0].data ? NGX_OK : NGX_ERROR;
+    }
+
+    /* the function, then each argument's length and bytes */
+    len = sizeof(func);
+    for (i = 1; i < argc; ++i) {
+        len += sizeof(size_t) + argv[i].len;
+    }
+
+    key = ngx_conf_script_alloc(ctx, len);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key, &func, sizeof(func));
+    for (i = 1; i < argc; ++i) {
+        p = ngx_cpymem(p, &argv[i].len, sizeof(size_t));
+        p = ngx_cpymem(p, argv[i].data, argv[i].len);
+    }
+
+    hash = ngx_hash_key(key, len);
+    elt = ngx_conf_script_hash_find(&ctx->memo, hash, key, len);
+    if (elt) {
+        ++ctx->memo_hits;
+        argv[0] = *(ngx_str_t *) elt->value;
+        return NGX_OK;
+    }
+
+    argv[0] = func->func(ccv->cf, argc - 1, &argv[1]);
+    if (argv[0].data == NULL) {
+        return NGX_ERROR;
+    }
+
+    elt = ngx_conf_script_hash_add(&ctx->memo, hash, key, len);
+    val = ngx_palloc(ctx->pool, sizeof(ngx_str_t) + argv[0].len);
+    if (elt == NULL || val == NULL) {
+        return NGX_ERROR;
+    }
+
+    val->len = argv[0].len;
+    val->data = (u_char *) &val[1];
+    ngx_memcpy(val->data, argv[0].data, argv[0].len);
+    elt->value = val;
+
+    argv[0] = *val;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_conf_script_add_functions(ngx_conf_t *cf, ngx_conf_script_func_t *funcs)
+{
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (/* void */; funcs->func; ++funcs) {
+        elt = ngx_conf_script_hash_add(&ctx->funcs,
+                                       ngx_hash_key(funcs->name.data,
+                                                    funcs->name.len),
+                                       funcs->name.data, funcs->name.len);
+        if (elt == NULL) {
+            return NGX_ERROR;
+        }
+        if (elt->value) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "config script function %V() "
+                               "is already defined", &funcs->name);
+            return NGX_ERROR;
+        }
+        elt->value = funcs;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_conf_script_ctx_t *
+ngx_conf_script_get_ctx(ngx_conf_t *cf)
+{
+    ngx_conf_script_ctx_t  *ctx;
+    ngx_pool_cleanup_t     *cln;
+
+    if (cf->cycle->conf_script) {
+        return cf->cycle->conf_script;
+    }
+
+    ctx = ngx_pcalloc(cf->temp_pool, sizeof(ngx_conf_script_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->cycle = cf->cycle;
+    ctx->pool = cf->temp_pool;
+    ctx->log = cf->log;
+
+    if (ngx_conf_script_hash_init(&ctx->syms, ctx->pool, 64) != NGX_OK
+        || ngx_conf_script_hash_init(&ctx->progs, ctx->pool, 64) != NGX_OK
+        || ngx_conf_script_hash_init(&ctx->funcs, ctx->pool, 16) != NGX_OK
+        || ngx_conf_script_hash_init(&ctx->memo, ctx->pool, 64) != NGX_OK
+        || ngx_conf_script_hash_init(&ctx->interned, ctx->pool, 64)
+           != NGX_OK
+        || ngx_conf_script_hash_init(&ctx->includes, ctx->pool, 64)
+           != NGX_OK)
+    {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->temp_pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_conf_script_ctx_cleanup;
+    cln->data = ctx;
+
+    cf->cycle->conf_script = ctx;
+
+    if (ngx_conf_script_add_functions(cf, ngx_conf_script_functions)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+void
+ngx_conf_script_ctx_cleanup(void *data)
+{
+    ngx_conf_script_ctx_t *ctx = data;
+
+    ngx_conf_script_arena_block_t  *block, *next;
+
+#if (NGX_THREADS)
+    if (ctx->prefetch) {
+        ngx_conf_script_prefetch_stop(ctx);
+    }
+#endif
+
+    ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                  "conf_scripts: %ui expressions compiled, "
+                  "%ui compilations saved by the cache, "
+                  "%ui function calls saved by memoization, "
+                  "%ui includes replayed, "
+                  "%uz bytes of scratch memory at peak, "
+                  "%uz bytes saved by sharing identical results",
+                  ctx->prog_misses, ctx->prog_hits, ctx->memo_hits,
+                  ctx->replayed, ctx->arena_peak, ctx->interned_saved);
+
+    if (ctx->store) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "conf_scripts: %ui expansions reused from the previous "
+                      "configuration, %ui recomputed",
+                      ctx->reused, ctx->recomputed);
+    }
+
+    if (ctx->snapshot) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "conf_scripts: %ui expansions taken from the snapshot, "
+                      "%ui computed",
+                      ctx->snapshot->taken, ctx->snapshot->computed);
+    }
+
+    if (ctx->fold) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "conf_scripts: %ui set directives in the "
+                      "configuration, %ui made constant, %ui dropped",
+                      ctx->sets, ctx->sets_folded - ctx->sets_dropped,
+                      ctx->sets_dropped);
+    }
+
+    for (block = ctx->arena; block; block = next) {
+        next = block->next;
+        ngx_free(block);
+    }
+
+    if (ctx->cycle->conf_script == ctx) {
+        ctx->cycle->conf_script = NULL;
+    }
+}
+
+
+void *
+ngx_conf_script_alloc(ngx_conf_script_ctx_t *ctx, size_t size)
+{
+    u_char                         *p;
+    size_t                          block_size;
+    ngx_conf_script_arena_block_t  *block, **prev;
+
+    size = ngx_align(size, NGX_ALIGNMENT);
+
+    if (ctx->arena_top.pos == NULL
+        || size > (size_t) (ctx->arena_end - ctx->arena_top.pos))
+    {
+        /* Move to the next block, unless it is too small for size: then
+         * insert a new one before it. */
+        prev = ctx->arena_top.block ? &ctx->arena_top.block->next
+                                    : &ctx->arena;
+        block = *prev;
+        if (block == NULL
+            || size > (size_t) (block->end - (u_char *) &block[1]))
+        {
+            block_size = ngx_max(size, NGX_CONF_SCRIPT_ARENA_SIZE);
+            block = ngx_alloc(sizeof(ngx_conf_script_arena_block_t)
+                              + block_size, ctx->log);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->end = (u_char *) &block[1] + block_size;
+            block->next = *prev;
+            *prev = block;
+        }
+
+        /* The unused tail of the previous block counts as used. */
+        ctx->arena_top.used += ctx->arena_end - ctx->arena_top.pos;
+        ctx->arena_top.block = block;
+        ctx->arena_top.pos = (u_char *) &block[1];
+        ctx->arena_end = block->end;
+    }
+
+    p = ctx->arena_top.pos;
+    ctx->arena_top.pos += size;
+    ctx->arena_top.used += size;
+    ctx->total.bytes += size;
+
+    if (ctx->arena_top.used > ctx->arena_peak) {
+        ctx->arena_peak = ctx->arena_top.used;
+    }
+
+    return p;
+}
+
+
+void
+ngx_conf_script_mark(ngx_conf_script_ctx_t *ctx, ngx_conf_script_mark_t *mark)
+{
+    *mark = ctx->arena_top;
+}
+
+
+/* Gives back everything allocated since mark was taken; the blocks stay
+ * around for the next evaluations. */
+
+void
+ngx_conf_script_release(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_mark_t *mark)
+{
+    ctx->arena_top = *mark;
+    ctx->arena_end = mark->block ? mark->block->end : NULL;
+}
+
+
+ngx_int_t
+ngx_conf_script_hash_init(ngx_conf_script_hash_t *hash, ngx_pool_t *pool,
+    ngx_uint_t size)
+{
+    /* size has to be a power of 2 */
+    hash->buckets = ngx_pcalloc(pool,
+                                size * sizeof(ngx_conf_script_hash_elt_t *));
+    if (hash->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash->size = size;
+    hash->nelts = 0;
+    hash->pool = pool;
+
+    return NGX_OK;
+}
+
+
+ngx_conf_script_hash_elt_t *
+ngx_conf_script_hash_find(ngx_conf_script_hash_t *hash, ngx_uint_t key,
+    u_char *name, size_t len)
+{
+    ngx_conf_script_hash_elt_t  *elt;
+
+    for (elt = hash->buckets[key & (hash->size - 1)]; elt; elt = elt->next) {
+        if (elt->key == key && elt->name.len == len
+            && ngx_memcmp(elt->name.data, name, len) == 0)
+        {
+            return elt;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Returns the existing element for name, or a new one (with a NULL value)
+ * holding its own copy of name. */
+
+ngx_conf_script_hash_elt_t *
+ngx_conf_script_hash_add(ngx_conf_script_hash_t *hash, ngx_uint_t key,
+    u_char *name, size_t len)
+{
+    ngx_uint_t                    i, size;
+    ngx_conf_script_hash_elt_t   *elt, *next, **buckets;
+
+    elt = ngx_conf_script_hash_find(hash, key, name, len);
+    if (elt) {
+        return elt;
+    }
+
+    if (hash->nelts >= hash->size) {
+        size = hash->size * 2;
+        buckets = ngx_pcalloc(hash->pool,
+                              size * sizeof(ngx_conf_script_hash_elt_t *));
+        if (buckets == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < hash->size; ++i) {
+            for (elt = hash->buckets[i]; elt; elt = next) {
+                next = elt->next;
+                elt->next = buckets[elt->key & (size - 1)];
+                buckets[elt->key & (size - 1)] = elt;
+            }
+        }
+        hash->buckets = buckets;
+        hash->size = size;
+    }
+
+    elt = ngx_palloc(hash->pool, sizeof(ngx_conf_script_hash_elt_t) + len);
+    if (elt == NULL) {
+        return NULL;
+    }
+
+    elt->key = key;
+    elt->name.len = len;
+    elt->name.data = (u_char *) &elt[1];
+    ngx_memcpy(elt->name.data, name, len);
+    elt->value = NULL;
+
+    elt->next = hash->buckets[key & (hash->size - 1)];
+    hash->buckets[key & (hash->size - 1)] = elt;
+    ++hash->nelts;
+
+    return elt;
+}
+
+
+/* Interns name into an integer id, unique for the configuration load.
+ * Returns NGX_DECLINED if name was never interned and create is not set. */
+
+ngx_int_t
+ngx_conf_script_sym(ngx_conf_script_ctx_t *ctx, ngx_str_t *name,
+    ngx_uint_t create)
+{
+    ngx_uint_t                   key;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    key = ngx_hash_key(name->data, name->len);
+
+    if (!create) {
+        elt = ngx_conf_script_hash_find(&ctx->syms, key, name->data,
+                                        name->len);
+        return elt ? (ngx_int_t) (uintptr_t) elt->value - 1 : NGX_DECLINED;
+    }
+
+    elt = ngx_conf_script_hash_add(&ctx->syms, key, name->data, name->len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (elt->value == NULL) {
+        elt->value = (void *) (uintptr_t) ++ctx->nsyms;
+    }
+
+    return (ngx_int_t) (uintptr_t) elt->value - 1;
+}
+
+
+/* Opens the scope of the current block level, seeing its parent's
+ * variables until it sets its own. */
+
+ngx_conf_script_vars_t *
+ngx_conf_script_vars_push(ngx_conf_t *cf)
+{
+    ngx_conf_script_vars_t *vars;
+
+    /* By putting our temp string in a temp pool, better use the
+     * result as soon as read or copy it to a more protected store. */
+    vars = ngx_palloc(cf->temp_pool, sizeof(ngx_conf_script_vars_t));
+    if (vars == NULL) {
+        return NULL;
+    }
+
+    if (cf->vars) {
+        vars->map = cf->vars->map;
+        vars->shift = cf->vars->shift;
+    } else {
+        vars->map = NULL;
+        vars->shift = 0;
+    }
+    vars->block_level = cf->cycle->conf_block_level;
+    vars->next = cf->vars;
+    cf->vars = vars;
+
+    return vars;
+}
+
+
+int
+ngx_conf_script_var_set(ngx_conf_t *cf, ngx_conf_script_vars_t *vars,
+    ngx_str_t *name, ngx_str_t *val)
+{
+    ngx_conf_script_var_t *var;
+
+    var = ngx_conf_script_var_add(cf, vars, name);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+    var->val.data = val->data;
+    var->val.len = val->len;
+    var->define = NULL;
+
+    return NGX_OK;
+}
+
+
+/* Binds name to value, to be expanded on first reference. */
+
+int
+ngx_conf_script_var_define(ngx_conf_t *cf, ngx_conf_script_vars_t *vars,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    ngx_str_t                  dir;
+    ngx_conf_script_var_t     *var;
+    ngx_conf_script_define_t  *def;
+
+    def = ngx_pcalloc(cf->temp_pool, sizeof(ngx_conf_script_define_t));
+    if (def == NULL) {
+        return NGX_ERROR;
+    }
+
+    def->value = *value;
+    def->delim = *cf->conf_file->script_delim;
+
+    if (ngx_array_init(&def->deps, cf->temp_pool, 4,
+                       sizeof(ngx_conf_script_dep_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* The file name may not outlive the file's parsing. */
+    ngx_conf_script_dir(cf, &dir);
+    def->dir.len = dir.len;
+    def->dir.data = ngx_pstrdup(cf->temp_pool, &dir);
+    if (def->dir.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    var = ngx_conf_script_var_add(cf, vars, name);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+    var->val.data = NULL;
+    var->val.len = 0;
+    var->define = def;
+
+    return NGX_OK;
+}
+
+
+/* Returns a new variable for name in vars, in place of the one it had or
+ * inherited. */
+
+ngx_conf_script_var_t *
+ngx_conf_script_var_add(ngx_conf_t *cf, ngx_conf_script_vars_t *vars,
+    ngx_str_t *name)
+{
+    void                   **loc;
+    uint32_t                 bit;
+    ngx_int_t                sym;
+    ngx_uint_t               shift;
+    ngx_conf_script_var_t   *var;
+    ngx_conf_script_map_t   *node;
+
+    sym = ngx_conf_script_sym(ngx_conf_script_get_ctx(cf), name, 1);
+    if (sym < 0) {
+        return NULL;
+    }
+
+    var = ngx_palloc(cf->temp_pool, sizeof(ngx_conf_script_var_t));
+    if (var == NULL) {
+        return NULL;
+    }
+    var->sym = sym;
+    var->block_level = vars->block_level;
+    var->name.data = name->data;
+    var->name.len = name->len;
+
+    /* Add levels on top until the root covers sym. */
+    while ((ngx_uint_t) sym >> vars->shift >> NGX_CONF_SCRIPT_MAP_BITS) {
+        if (vars->map) {
+            node = ngx_conf_script_map_copy(cf->temp_pool, vars, NULL, 1);
+            if (node == NULL) {
+                return NULL;
+            }
+            node->slot[0] = vars->map;
+            vars->map = node;
+        }
+        vars->shift += NGX_CONF_SCRIPT_MAP_BITS;
+    }
+
+    loc = (void **) &vars->map;
+    shift = vars->shift;
+
+    for ( ;; ) {
+        node = *loc;
+        bit = (uint32_t) 1 << ((sym >> shift) & 31);
+
+        if (node == NULL || node->owner != vars || !(node->bitmap & bit)) {
+            node = ngx_conf_script_map_copy(cf->temp_pool, vars, node, bit);
+            if (node == NULL) {
+                return NULL;
+            }
+            *loc = node;
+        }
+
+        loc = &node->slot[ngx_conf_script_popcount(node->bitmap & (bit - 1))];
+
+        if (shift == 0) {
+            *loc = var;
+            return var;
+        }
+        shift -= NGX_CONF_SCRIPT_MAP_BITS;
+    }
+}
+
+
+/* Finds sym's variable in a single descent of the map, whatever the block
+ * level that set it. */
+
+ngx_conf_script_var_t *
+ngx_conf_script_var_find(ngx_conf_script_vars_t *vars, ngx_uint_t sym,
+    ngx_uint_t *depth)
+{
+    void                   *slot;
+    uint32_t                bit;
+    ngx_uint_t              shift;
+    ngx_conf_script_map_t  *node;
+
+    *depth = 0;
+
+    if (sym >> vars->shift >> NGX_CONF_SCRIPT_MAP_BITS) {
+        return NULL;
+    }
+
+    for (node = vars->map, shift = vars->shift; node; /* void */) {
+        ++*depth;
+        bit = (uint32_t) 1 << ((sym >> shift) & 31);
+        if (!(node->bitmap & bit)) {
+            return NULL;
+        }
+        slot = node->slot[ngx_conf_script_popcount(node->bitmap & (bit - 1))];
+        if (shift == 0) {
+            return slot;
+        }
+        node = slot;
+        shift -= NGX_CONF_SCRIPT_MAP_BITS;
+    }
+
+    return NULL;
+}
+
+
+/* Copies node for vars to change, with room for bit's slot. */
+
+ngx_conf_script_map_t *
+ngx_conf_script_map_copy(ngx_pool_t *pool, ngx_conf_script_vars_t *vars,
+    ngx_conf_script_map_t *node, uint32_t bit)
+{
+    uint32_t                bitmap;
+    ngx_uint_t              n, pos;
+    ngx_conf_script_map_t  *copy;
+
+    bitmap = (node ? node->bitmap : 0) | bit;
+    n = ngx_conf_script_popcount(bitmap);
+
+    copy = ngx_palloc(pool, offsetof(ngx_conf_script_map_t, slot)
+                            + n * sizeof(void *));
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->owner = vars;
+    copy->bitmap = bitmap;
+
+    if (node == NULL) {
+        copy->slot[0] = NULL;
+        return copy;
+    }
+
+    pos = ngx_conf_script_popcount(bitmap & (bit - 1));
+    if (node->bitmap & bit) {
+        ngx_memcpy(copy->slot, node->slot, n * sizeof(void *));
+    } else {
+        ngx_memcpy(copy->slot, node->slot, pos * sizeof(void *));
+        copy->slot[pos] = NULL;
+        ngx_memcpy(&copy->slot[pos + 1], &node->slot[pos],
+                   (n - 1 - pos) * sizeof(void *));
+    }
+
+    return copy;
+}
+
+
+ngx_uint_t
+ngx_conf_script_popcount(uint32_t bits)
+{
+    bits = bits - ((bits >> 1) & 0x55555555);
+    bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F;
+
+    return (bits * 0x01010101) >> 24;
+}
+
+
+ngx_int_t
+ngx_conf_script_file_start(ngx_conf_t *cf)
+{
+    ngx_conf_script_ctx_t   *ctx;
+    ngx_conf_script_file_t  *file;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->file == NULL) {
+        ngx_gettimeofday(&ctx->start);
+    }
+
+    file = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_file_t));
+    if (file == NULL) {
+        return NGX_ERROR;
+    }
+
+    file->conf_file = cf->conf_file;
+    ngx_conf_script_file_dir(&cf->conf_file->file.name, &file->dir);
+    file->prev = ctx->file;
+    ctx->file = file;
+    ++ctx->opened;
+
+    if (ngx_conf_script_include_start(ctx, file) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if (ctx->prefetch && file->replay == NULL) {
+        file->fetch = ngx_conf_script_prefetch_take(ctx, cf->conf_file);
+        if (file->fetch
+            && ngx_conf_script_prefetch_scan(cf, file->fetch->data,
+                                             file->fetch->data
+                                             + file->fetch->size)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    /* after the take, to hash what was read ahead */
+    if (ctx->snapshot && ngx_conf_script_snapshot_file(ctx, cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_conf_script_file_done(ngx_conf_t *cf)
+{
+    ngx_conf_script_ctx_t  *ctx;
+
+    ctx = cf->cycle->conf_script;
+    if (ctx == NULL || ctx->file == NULL
+        || ctx->file->conf_file != cf->conf_file)
+    {
+        return;
+    }
+
+    if (ctx->file->record) {
+        ngx_conf_script_include_abort(ctx->file);
+    }
+
+#if (NGX_THREADS)
+    if (ctx->file->fetch) {
+        ngx_conf_script_prefetch_release(ctx->file->fetch);
+    }
+#endif
+
+    ctx->file = ctx->file->prev;
+
+    if (ctx->file == NULL && ctx->stats) {
+        ngx_conf_script_stats_report(ctx);
+    }
+
+    if (ctx->file == NULL && ctx->snapshot && ctx->snapshot->parsed) {
+        ngx_conf_script_snapshot_write(ctx);
+    }
+}
+
+
+/* Keeps this load's expansions on the cycle, for the next load to reuse
+ * those whose file and dependencies did not change. */
+
+ngx_int_t
+ngx_conf_script_reuse(ngx_conf_t *cf, ngx_uint_t on)
+{
+    ngx_conf_script_ctx_t    *ctx;
+    ngx_conf_script_store_t  *store;
+    ngx_pool_cleanup_t       *cln;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (!on) {
+        ctx->store = NULL;
+        return NGX_OK;
+    }
+
+    store = cf->cycle->conf_script_store;
+
+    if (store == NULL) {
+        store = ngx_palloc(cf->cycle->pool, sizeof(ngx_conf_script_store_t));
+        if (store == NULL
+            || ngx_conf_script_hash_init(&store->files, cf->cycle->pool, 64)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+        cln->handler = ngx_conf_script_store_cleanup;
+        cln->data = cf->cycle;
+
+        cf->cycle->conf_script_store = store;
+    }
+
+    if (ctx->deps.elts == NULL
+        && ngx_array_init(&ctx->deps, ctx->pool, 8,
+                          sizeof(ngx_conf_script_dep_t))
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->store = store;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_conf_script_store_cleanup(void *data)
+{
+    ngx_cycle_t  *cycle = data;
+
+    cycle->conf_script_store = NULL;
+}
+
+
+int
+ngx_conf_script_reuse_expand(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string)
+{
+    int                        rc;
+    u_char                    *key;
+    size_t                     len;
+    ngx_conf_script_mark_t     mark;
+    ngx_conf_script_stored_t  *stored;
+
+    if (ngx_conf_script_find_delim(string->data, string->data + string->len,
+                                   &cf->conf_file->script_delim->open)
+        == NULL)
+    {
+        return NGX_OK;
+    }
+
+    ngx_conf_script_mark(ctx, &mark);
+
+    key = ngx_conf_script_reuse_key(ctx, cf, string, &len);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_conf_script_reuse_find(ctx, cf, key, len, string, &stored);
+    if (rc != NGX_DECLINED) {
+        /* kept again, for the load after this one */
+        if (rc == NGX_OK) {
+            ++ctx->reused;
+            rc = ngx_conf_script_reuse_store(ctx, cf, key, len, string,
+                                             stored->deps, stored->ndeps);
+        }
+        ngx_conf_script_release(ctx, &mark);
+        return rc;
+    }
+
+    ++ctx->recomputed;
+
+    ctx->deps.nelts = 0;
+    ctx->recording = 1;
+    ctx->volatile_ = 0;
+
+    rc = ctx->stats ? ngx_conf_script_profile(ctx, cf, string)
+                    : ngx_conf_ccv_expand(cf, string);
+
+    ctx->recording = 0;
+
+    if (rc == NGX_OK && !ctx->volatile_
+        && ngx_conf_script_reuse_store(ctx, cf, key, len, string,
+                                       ctx->deps.elts, ctx->deps.nelts)
+           != NGX_OK)
+    {
+        rc = NGX_ERROR;
+    }
+
+    ngx_conf_script_release(ctx, &mark);
+
+    return rc;
+}
+
+
+/* An expansion is looked up by the marks it was written with, and its
+ * text. */
+
+u_char *
+ngx_conf_script_reuse_key(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string, size_t *len)
+{
+    u_char                   *key, *p;
+    ngx_conf_script_delim_t  *delim;
+
+    delim = cf->conf_file->script_delim;
+
+    *len = 2 * sizeof(size_t) + delim->open.len + delim->close.len
+           + string->len;
+
+    key = ngx_conf_script_alloc(ctx, *len);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(key, &delim->open.len, sizeof(size_t));
+    p = ngx_cpymem(p, delim->open.data, delim->open.len);
+    p = ngx_cpymem(p, &delim->close.len, sizeof(size_t));
+    p = ngx_cpymem(p, delim->close.data, delim->close.len);
+    ngx_memcpy(p, string->data, string->len);
+
+    return key;
+}
+
+
+/* Looks for what the previous load got expanding the same text in the same
+ * file, with the same values for what it read, and gives it in found. Those
+ * values are looked up again, but the expression need not be compiled nor
+ * run. */
+
+ngx_int_t
+ngx_conf_script_reuse_find(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    u_char *key, size_t len, ngx_str_t *string,
+    ngx_conf_script_stored_t **found)
+{
+    int                             rc;
+    ngx_str_t                      *name, val;
+    ngx_uint_t                      i;
+    ngx_file_info_t                *info;
+    ngx_conf_ccv_t                  ccv;
+    ngx_conf_script_store_t        *store;
+    ngx_conf_script_stored_t       *stored;
+    ngx_conf_script_stored_file_t  *file;
+    ngx_conf_script_hash_elt_t     *elt;
+
+    if (cf->cycle->old_cycle == NULL) {
+        return NGX_DECLINED;
+    }
+
+    store = cf->cycle->old_cycle->conf_script_store;
+    if (store == NULL) {
+        return NGX_DECLINED;
+    }
+
+    name = &cf->conf_file->file.name;
+    elt = ngx_conf_script_hash_find(&store->files,
+                                    ngx_hash_key(name->data, name->len),
+                                    name->data, name->len);
+    if (elt == NULL) {
+        return NGX_DECLINED;
+    }
+
+    file = elt->value;
+    info = &cf->conf_file->file.info;
+
+    if (ngx_file_uniq(&file->info) != ngx_file_uniq(info)
+        || ngx_file_size(&file->info) != ngx_file_size(info)
+        || ngx_file_mtime(&file->info) != ngx_file_mtime(info))
+    {
+        return NGX_DECLINED;
+    }
+
+    elt = ngx_conf_script_hash_find(&file->values, ngx_hash_key(key, len),
+                                    key, len);
+    if (elt == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* Only enough of an expansion to look variables up. */
+    ccv.cf = cf;
+    ccv.ctx = ctx;
+    ccv.value = string;
+
+    for (stored = elt->value; stored; stored = stored->next) {
+
+        for (i = 0; i < stored->ndeps; ++i) {
+            if (stored->deps[i].name.len == 1
+                && stored->deps[i].name.data[0] == '.')
+            {
+                ngx_conf_script_dir(cf, &val);
+
+            } else {
+                rc = ngx_conf_ccv_lookup_var(&ccv, &stored->deps[i].name,
+                                             &val);
+                if (rc == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+                if (rc == NGX_DECLINED) {
+                    break;
+                }
+            }
+
+            if (val.len != stored->deps[i].val.len
+                || ngx_memcmp(val.data, stored->deps[i].val.data, val.len)
+                   != 0)
+            {
+                break;
+            }
+        }
+
+        if (i == stored->ndeps) {
+            break;
+        }
+    }
+
+    if (stored == NULL) {
+        return NGX_DECLINED;
+    }
+
+    *found = stored;
+
+    /* The previous cycle's pool will be gone with it. */
+    return ngx_conf_script_intern(ctx, cf, stored->result.data,
+                                  stored->result.len, string);
+}
+
+
+/* Keeps result, and the values of deps it was computed from, for the next
+ * load; along with the other variants of the same text, unless it is one of
+ * them. */
+
+ngx_int_t
+ngx_conf_script_reuse_store(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    u_char *key, size_t len, ngx_str_t *result, ngx_conf_script_dep_t *deps,
+    ngx_uint_t ndeps)
+{
+    ngx_str_t                      *name;
+    ngx_uint_t                      i, n;
+    ngx_pool_t                     *pool;
+    ngx_conf_script_stored_t       *stored, **last;
+    ngx_conf_script_stored_file_t  *file;
+    ngx_conf_script_hash_elt_t     *elt;
+
+    pool = cf->cycle->pool;
+    name = &cf->conf_file->file.name;
+
+    elt = ngx_conf_script_hash_add(&ctx->store->files,
+                                   ngx_hash_key(name->data, name->len),
+                                   name->data, name->len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    file = elt->value;
+
+    if (file == NULL) {
+        file = ngx_palloc(pool, sizeof(ngx_conf_script_stored_file_t));
+        if (file == NULL
+            || ngx_conf_script_hash_init(&file->values, pool, 16) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        file->info = cf->conf_file->file.info;
+        elt->value = file;
+    }
+
+    elt = ngx_conf_script_hash_add(&file->values, ngx_hash_key(key, len),
+                                   key, len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0, last = (ngx_conf_script_stored_t **) &elt->value;
+         *last;
+         last = &(*last)->next, ++n)
+    {
+        stored = *last;
+
+        if (stored->ndeps != ndeps) {
+            continue;
+        }
+
+        for (i = 0; i < ndeps; ++i) {
+            if (stored->deps[i].name.len != deps[i].name.len
+                || stored->deps[i].val.len != deps[i].val.len
+                || ngx_memcmp(stored->deps[i].name.data, deps[i].name.data,
+                              deps[i].name.len)
+                   != 0
+                || ngx_memcmp(stored->deps[i].val.data, deps[i].val.data,
+                              deps[i].val.len)
+                   != 0)
+            {
+                break;
+            }
+        }
+
+        if (i == ndeps) {
+            return NGX_OK;
+        }
+    }
+
+    if (n >= NGX_CONF_SCRIPT_STORED_MAX) {
+        return NGX_OK;
+    }
+
+    stored = ngx_palloc(pool, sizeof(ngx_conf_script_stored_t)
+                              + ndeps * sizeof(ngx_conf_script_dep_t));
+    if (stored == NULL) {
+        return NGX_ERROR;
+    }
+
+    stored->next = NULL;
+    stored->ndeps = ndeps;
+    stored->deps = (ngx_conf_script_dep_t *) &stored[1];
+
+    stored->result.len = result->len;
+    stored->result.data = ngx_pstrdup(pool, result);
+    if (stored->result.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ndeps; ++i) {
+        stored->deps[i].name.len = deps[i].name.len;
+        stored->deps[i].name.data = ngx_pstrdup(pool, &deps[i].name);
+        stored->deps[i].val.len = deps[i].val.len;
+        stored->deps[i].val.data = ngx_pstrdup(pool, &deps[i].val);
+        if (stored->deps[i].name.data == NULL
+            || stored->deps[i].val.data == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    *last = stored;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_conf_script_dep_add(ngx_array_t *deps, ngx_str_t *name, ngx_str_t *val)
+{
+    ngx_conf_script_dep_t  *dep;
+
+    dep = ngx_array_push(deps);
+    if (dep == NULL) {
+        return NGX_ERROR;
+    }
+
+    dep->name = *name;
+    dep->val = *val;
+
+    return NGX_OK;
+}
+
+
+/* Snapshots: what every expansion of a configuration load gave, in order,
+ * along with the files it read. The next load, if fed the same files, takes
+ * the expanded arguments from there instead of running scripts.
+ *
+ * The file is mapped privately, so that arguments can point into it and
+ * still be modified in place by directive handlers. Numbers are native:
+ * a snapshot written by another build is simply ignored. */
+
+ngx_int_t
+ngx_conf_script_snapshot(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_snapshot_t  *snap;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->snapshot) {
+        return NGX_DECLINED;
+    }
+
+    /* Nothing before may have been computed from outside the main file. */
+    if (ctx->opened != 1 || ctx->total.calls) {
+        return NGX_BUSY;
+    }
+
+    /* Arguments taken from the mapping live as long as the cycle. */
+    snap = ngx_pcalloc(cf->cycle->pool, sizeof(ngx_conf_script_snapshot_t));
+    if (snap == NULL) {
+        return NGX_ERROR;
+    }
+
+    snap->name = *name;
+    if (ngx_conf_full_name(cf->cycle, &snap->name, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&snap->out, ctx->pool, 4096, 1) != NGX_OK
+        || ngx_conf_script_hash_init(&snap->digests, ctx->pool, 64) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_conf_script_snapshot_map(ctx, snap, cf);
+
+    ctx->snapshot = snap;
+
+    return ngx_conf_script_snapshot_file(ctx, cf);
+}
+
+
+void
+ngx_conf_script_snapshot_map(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_snapshot_t *snap, ngx_conf_t *cf)
+{
+    u_char                              param[16];
+    ngx_fd_t                            fd;
+    ngx_md5_t                           md5;
+    ngx_file_info_t                     fi;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_conf_script_snapshot_header_t  *header;
+
+    fd = ngx_open_file(snap->name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+        || ngx_file_size(&fi) < (off_t) sizeof(*header))
+    {
+        ngx_close_file(fd);
+        return;
+    }
+
+    snap->map_size = ngx_file_size(&fi);
+    snap->map = mmap(NULL, snap->map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+
+    ngx_close_file(fd);
+
+    if (snap->map == MAP_FAILED) {
+        snap->map = NULL;
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+    if (cln == NULL) {
+        ngx_conf_script_snapshot_unmap(snap);
+        return;
+    }
+    cln->handler = ngx_conf_script_snapshot_unmap;
+    cln->data = snap;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, cf->cycle->conf_param.data,
+                   cf->cycle->conf_param.len);
+    ngx_md5_final(param, &md5);
+
+    header = (ngx_conf_script_snapshot_header_t *) snap->map;
+
+    if (ngx_memcmp(header->magic, NGX_CONF_SCRIPT_SNAPSHOT_MAGIC, 8) != 0
+        || header->version != NGX_CONF_SCRIPT_SNAPSHOT_VERSION
+        || header->order != 0x01020304
+        || header->size != snap->map_size
+        || ngx_memcmp(header->param, param, 16) != 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "conf_scripts: ignoring snapshot \"%V\"", &snap->name);
+        ngx_conf_script_snapshot_unmap(snap);
+        return;
+    }
+
+    snap->pos = snap->map + sizeof(*header);
+    snap->last = snap->map + snap->map_size;
+    snap->left = header->nrecs;
+    snap->valid = 1;
+}
+
+
+void
+ngx_conf_script_snapshot_unmap(void *data)
+{
+    ngx_conf_script_snapshot_t  *snap = data;
+
+    if (snap->map) {
+        munmap(snap->map, snap->map_size);
+        snap->map = NULL;
+    }
+    snap->valid = 0;
+}
+
+
+ngx_conf_script_snapshot_rec_t *
+ngx_conf_script_snapshot_next(ngx_conf_script_snapshot_t *snap,
+    ngx_uint_t type)
+{
+    size_t                           size;
+    ngx_conf_script_snapshot_rec_t  *rec;
+
+    if (!snap->valid || snap->left == 0
+        || (size_t) (snap->last - snap->pos) < sizeof(*rec))
+    {
+        return NULL;
+    }
+
+    rec = (ngx_conf_script_snapshot_rec_t *) snap->pos;
+    size = sizeof(*rec) + ngx_align((size_t) rec->len + rec->len2 + 2, 8);
+
+    if (rec->type != type || size > (size_t) (snap->last - snap->pos)) {
+        return NULL;
+    }
+
+    snap->pos += size;
+    --snap->left;
+
+    return rec;
+}
+
+
+void
+ngx_conf_script_snapshot_invalidate(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_t *cf)
+{
+    ngx_conf_script_snapshot_t  *snap;
+
+    snap = ctx->snapshot;
+
+    if (snap->valid) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "conf_scripts: snapshot \"%V\" outdated from %V:%ui",
+                      &snap->name, &cf->conf_file->file.name,
+                      cf->conf_file->line);
+        snap->valid = 0;
+    }
+}
+
+
+ngx_int_t
+ngx_conf_script_snapshot_append(ngx_conf_script_snapshot_t *snap,
+    ngx_conf_script_snapshot_rec_t *rec, ngx_str_t *s, ngx_str_t *s2)
+{
+    u_char  *p;
+    size_t   size;
+
+    rec->len = s->len;
+    rec->len2 = s2 ? s2->len : 0;
+
+    size = sizeof(*rec) + ngx_align((size_t) rec->len + rec->len2 + 2, 8);
+
+    p = ngx_array_push_n(&snap->out, size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(p, size);
+    p = ngx_cpymem(p, rec, sizeof(*rec));
+    p = ngx_cpymem(p, s->data, s->len) + 1;
+    if (s2) {
+        ngx_memcpy(p, s2->data, s2->len);
+    }
+
+    ++snap->nrecs;
+
+    return NGX_OK;
+}
+
+
+/* Called as each file gets opened: the snapshot stays usable as long as the
+ * same files, with the same contents, get opened in the same order. */
+
+ngx_int_t
+ngx_conf_script_snapshot_file(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf)
+{
+    ngx_str_t                       *name;
+    ngx_conf_script_snapshot_rec_t   rec, *old;
+
+    ngx_memzero(&rec, sizeof(rec));
+    rec.type = NGX_CONF_SCRIPT_SNAPSHOT_FILE;
+    rec.size = ngx_file_size(&cf->conf_file->file.info);
+
+    if (ngx_conf_script_file_md5(ctx, cf, rec.md5) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    name = &cf->conf_file->file.name;
+
+    if (ctx->snapshot->valid) {
+        old = ngx_conf_script_snapshot_next(ctx->snapshot,
+                                            NGX_CONF_SCRIPT_SNAPSHOT_FILE);
+        if (old == NULL
+            || old->size != rec.size
+            || ngx_memcmp(old->md5, rec.md5, 16) != 0
+            || old->len != name->len
+            || ngx_memcmp(&old[1], name->data, name->len) != 0)
+        {
+            ngx_conf_script_snapshot_invalidate(ctx, cf);
+        }
+    }
+
+    return ngx_conf_script_snapshot_append(ctx->snapshot, &rec, name, NULL);
+}
+
+
+/* Hashes a file once per load, however many times it gets included, and
+ * from memory when it was read ahead. */
+
+ngx_int_t
+ngx_conf_script_file_md5(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    u_char *result)
+{
+    off_t                        offset, saved;
+    u_char                      *buf;
+    ssize_t                      n;
+    ngx_md5_t                    md5;
+    ngx_file_t                  *file;
+    ngx_conf_script_mark_t       mark;
+    ngx_conf_script_digest_t    *digest;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    file = &cf->conf_file->file;
+
+    elt = ngx_conf_script_hash_add(&ctx->snapshot->digests,
+                                   ngx_hash_key(file->name.data,
+                                                file->name.len),
+                                   file->name.data, file->name.len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    digest = elt->value;
+
+    if (digest
+        && ngx_file_uniq(&digest->info) == ngx_file_uniq(&file->info)
+        && ngx_file_size(&digest->info) == ngx_file_size(&file->info)
+        && ngx_file_mtime(&digest->info) == ngx_file_mtime(&file->info))
+    {
+        ngx_memcpy(result, digest->md5, 16);
+        return NGX_OK;
+    }
+
+    ngx_md5_init(&md5);
+
+#if (NGX_THREADS)
+    if (ctx->file && ctx->file->conf_file == cf->conf_file
+        && ctx->file->fetch)
+    {
+        ngx_md5_update(&md5, ctx->file->fetch->data, ctx->file->fetch->size);
+        goto done;
+    }
+#endif
+
+    ngx_conf_script_mark(ctx, &mark);
+
+    buf = ngx_conf_script_alloc(ctx, NGX_CONF_SCRIPT_ARENA_SIZE);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* ngx_read_file() moves the offset the parser reads from. */
+    saved = file->offset;
+
+    for (offset = 0; offset < ngx_file_size(&file->info); offset += n) {
+        n = ngx_read_file(file, buf, NGX_CONF_SCRIPT_ARENA_SIZE, offset);
+        if (n == NGX_ERROR) {
+            file->offset = saved;
+            ngx_conf_script_release(ctx, &mark);
+            return NGX_ERROR;
+        }
+        if (n == 0) {
+            break;
+        }
+        ngx_md5_update(&md5, buf, n);
+    }
+
+    file->offset = saved;
+    ngx_conf_script_release(ctx, &mark);
+
+#if (NGX_THREADS)
+done:
+#endif
+
+    ngx_md5_final(result, &md5);
+
+    if (digest == NULL) {
+        digest = ngx_palloc(ctx->pool, sizeof(ngx_conf_script_digest_t));
+        if (digest == NULL) {
+            return NGX_ERROR;
+        }
+        elt->value = digest;
+    }
+
+    digest->info = file->info;
+    ngx_memcpy(digest->md5, result, 16);
+
+    return NGX_OK;
+}
+
+
+/* Takes the expansion from the snapshot while it is valid, else computes
+ * it; either way it goes to the next snapshot. Results of functions that
+ * are not pure are always computed, and the rest of the snapshot is only
+ * trusted if they did not change. */
+
+int
+ngx_conf_script_snapshot_expand(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string)
+{
+    int                              rc;
+    u_char                          *p;
+    ngx_str_t                        raw, result;
+    ngx_conf_script_snapshot_t      *snap;
+    ngx_conf_script_snapshot_rec_t   rec, *old;
+
+    if (ngx_conf_script_find_delim(string->data, string->data + string->len,
+                                   &cf->conf_file->script_delim->open)
+        == NULL)
+    {
+        return NGX_OK;
+    }
+
+    snap = ctx->snapshot;
+    raw = *string;
+
+    ngx_memzero(&rec, sizeof(rec));
+    rec.type = NGX_CONF_SCRIPT_SNAPSHOT_VALUE;
+
+    old = NULL;
+
+    if (snap->valid) {
+        old = ngx_conf_script_snapshot_next(snap,
+                                            NGX_CONF_SCRIPT_SNAPSHOT_VALUE);
+        if (old == NULL
+            || old->len != raw.len
+            || ngx_memcmp(&old[1], raw.data, raw.len) != 0)
+        {
+            ngx_conf_script_snapshot_invalidate(ctx, cf);
+            old = NULL;
+        }
+    }
+
+    if (old) {
+        p = (u_char *) &old[1] + old->len + 1;
+        result.data = p;
+        result.len = old->len2;
+
+        if (!(old->flags & NGX_CONF_SCRIPT_SNAPSHOT_VOLATILE)) {
+            ++snap->taken;
+            *string = result;
+            return ngx_conf_script_snapshot_append(snap, &rec, &raw, string);
+        }
+    }
+
+    ctx->volatile_ = 0;
+
+    rc = ngx_conf_script_expand(ctx, cf, string);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ++snap->computed;
+
+    if (ctx->volatile_) {
+        rec.flags = NGX_CONF_SCRIPT_SNAPSHOT_VOLATILE;
+
+        if (old
+            && (result.len != string->len
+                || ngx_memcmp(result.data, string->data, result.len) != 0))
+        {
+            ngx_conf_script_snapshot_invalidate(ctx, cf);
+        }
+    }
+
+    return ngx_conf_script_snapshot_append(snap, &rec, &raw, string);
+}
+
+
+/* Once the whole configuration parsed: written aside then renamed, as a
+ * previous snapshot may still be mapped. */
+
+void
+ngx_conf_script_snapshot_write(ngx_conf_script_ctx_t *ctx)
+{
+    u_char                             *tmp;
+    ngx_fd_t                            fd;
+    ngx_md5_t                           md5;
+    ngx_conf_script_snapshot_t         *snap;
+    ngx_conf_script_snapshot_header_t   header;
+
+    snap = ctx->snapshot;
+
+    if (snap->valid && snap->left == 0 && snap->pos == snap->last) {
+        /* unchanged */
+        return;
+    }
+
+    ngx_memzero(&header, sizeof(header));
+    ngx_memcpy(header.magic, NGX_CONF_SCRIPT_SNAPSHOT_MAGIC, 8);
+    header.version = NGX_CONF_SCRIPT_SNAPSHOT_VERSION;
+    header.order = 0x01020304;
+    header.size = sizeof(header) + snap->out.nelts;
+    header.nrecs = snap->nrecs;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, ctx->cycle->conf_param.data,
+                   ctx->cycle->conf_param.len);
+    ngx_md5_final(header.param, &md5);
+
+    tmp = ngx_pnalloc(ctx->pool, snap->name.len + sizeof(".tmp"));
+    if (tmp == NULL) {
+        return;
+    }
+    ngx_sprintf(tmp, "%V.tmp%Z", &snap->name);
+
+    fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", tmp);
+        return;
+    }
+
+    if (ngx_write_fd(fd, &header, sizeof(header)) != sizeof(header)
+        || ngx_write_fd(fd, snap->out.elts, snap->out.nelts)
+           != (ssize_t) snap->out.nelts)
+    {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", tmp);
+        ngx_close_file(fd);
+        ngx_delete_file(tmp);
+        return;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", tmp);
+    }
+
+    if (ngx_rename_file(tmp, snap->name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      tmp, &snap->name);
+        ngx_delete_file(tmp);
+    }
+}
+
+
+/* Replaces ngx_conf_read_token() in ngx_conf_parse(): the tokens of a file
+ * opened for the third time or more are replayed from what was recorded
+ * the second time, unless the file changed. Everything else, from the
+ * conf_scripts marks to variables, comes from the replay site as it would
+ * have after reading the file again. */
+
+ngx_int_t
+ngx_conf_script_read_token(ngx_conf_t *cf,
+    ngx_conf_script_read_token_pt read_token)
+{
+    ngx_int_t               rc;
+    ngx_conf_script_ctx_t  *ctx;
+    ngx_conf_script_file_t *file;
+
+    ctx = cf->cycle->conf_script;
+    if (ctx == NULL) {
+        return read_token(cf);
+    }
+
+    ctx->read_token = read_token;
+    ++ctx->ntokens;
+    file = ctx->file;
+
+    if (file == NULL || file->conf_file != cf->conf_file) {
+        return read_token(cf);
+    }
+
+    if (file->loop) {
+        return ngx_conf_script_loop_replay(cf, file->loop);
+    }
+
+    if (file->replay) {
+        return ngx_conf_script_include_replay(cf, file);
+    }
+
+    rc = read_token(cf);
+
+    if (rc == NGX_CONF_FILE_DONE && file->prev == NULL && ctx->snapshot) {
+        ctx->snapshot->parsed = 1;
+    }
+
+    if (file->record
+        && ngx_conf_script_include_record(ctx, cf, rc) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_conf_script_include_start(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_file_t *file)
+{
+    ngx_str_t                   *name;
+    ngx_file_info_t             *info;
+    ngx_conf_script_include_t   *inc;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    /* nginx -T wants the file's text */
+    if (file->conf_file->dump) {
+        return NGX_OK;
+    }
+
+    name = &file->conf_file->file.name;
+    info = &file->conf_file->file.info;
+
+    elt = ngx_conf_script_hash_add(&ctx->includes,
+                                   ngx_hash_key(name->data, name->len),
+                                   name->data, name->len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    inc = elt->value;
+
+    if (inc == NULL) {
+        inc = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_include_t));
+        if (inc == NULL) {
+            return NGX_ERROR;
+        }
+        elt->value = inc;
+    }
+
+    /* Most files are only read once: only record the second time. */
+    if (++inc->opens < 2 || inc->recording) {
+        return NGX_OK;
+    }
+
+    if (inc->complete
+        && ngx_file_uniq(&inc->info) == ngx_file_uniq(info)
+        && ngx_file_size(&inc->info) == ngx_file_size(info)
+        && ngx_file_mtime(&inc->info) == ngx_file_mtime(info))
+    {
+        file->replay = inc;
+        file->next_token = 0;
+        ++ctx->replayed;
+        return NGX_OK;
+    }
+
+    if (inc->tokens.elts == NULL) {
+        if (ngx_array_init(&inc->tokens, ctx->pool, 64,
+                           sizeof(ngx_conf_script_token_t))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    inc->tokens.nelts = 0;
+    inc->info = *info;
+    inc->complete = 0;
+    inc->recording = 1;
+    file->record = inc;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_conf_script_include_abort(ngx_conf_script_file_t *file)
+{
+    file->record->tokens.nelts = 0;
+    file->record->recording = 0;
+    file->record = NULL;
+}
+
+
+/* Keeps the token just read for the file's next opens. */
+
+ngx_int_t
+ngx_conf_script_include_record(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_int_t rc)
+{
+    ngx_conf_script_include_t  *inc;
+
+    inc = ctx->file->record;
+
+    if (rc == NGX_ERROR) {
+        ngx_conf_script_include_abort(ctx->file);
+        return NGX_OK;
+    }
+
+    if (ngx_conf_script_token_copy(ctx->pool, cf, rc, &inc->tokens)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_CONF_FILE_DONE) {
+        inc->complete = 1;
+        inc->recording = 0;
+        ctx->file->record = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_conf_script_include_replay(ngx_conf_t *cf, ngx_conf_script_file_t *file)
+{
+    ngx_conf_script_token_t  *token;
+
+    token = file->replay->tokens.elts;
+
+    return ngx_conf_script_token_replay(cf, &token[file->next_token++]);
+}
+
+
+/* Appends a copy of the token just read to tokens, the original being left
+ * to the directive, which may modify or keep it. */
+
+ngx_int_t
+ngx_conf_script_token_copy(ngx_pool_t *pool, ngx_conf_t *cf, ngx_int_t rc,
+    ngx_array_t *tokens)
+{
+    u_char                   *p;
+    size_t                    len;
+    ngx_uint_t                i;
+    ngx_str_t                *args;
+    ngx_conf_script_token_t  *token;
+
+    token = ngx_array_push(tokens);
+    if (token == NULL) {
+        return NGX_ERROR;
+    }
+
+    args = cf->args->elts;
+
+    len = cf->args->nelts * sizeof(ngx_str_t);
+    for (i = 0; i < cf->args->nelts; ++i) {
+        len += args[i].len + 1;
+    }
+
+    token->rc = rc;
+    token->line = cf->conf_file->line;
+    token->nargs = cf->args->nelts;
+    token->args = ngx_palloc(pool, len);
+    if (token->args == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = (u_char *) &token->args[token->nargs];
+    for (i = 0; i < token->nargs; ++i) {
+        token->args[i].len = args[i].len;
+        token->args[i].data = p;
+        p = ngx_cpymem(p, args[i].data, args[i].len);
+        *p++ = '\0';
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_conf_script_token_replay(ngx_conf_t *cf, ngx_conf_script_token_t *token)
+{
+    ngx_uint_t   i;
+    ngx_str_t   *word;
+
+    cf->args->nelts = 0;
+    cf->conf_file->line = token->line;
+
+    /* fresh copies, as directives may modify or keep what they get */
+    for (i = 0; i < token->nargs; ++i) {
+        word = ngx_array_push(cf->args);
+        if (word == NULL) {
+            return NGX_ERROR;
+        }
+        word->len = token->args[i].len;
+        word->data = ngx_pnalloc(cf->pool, word->len + 1);
+        if (word->data == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(word->data, token->args[i].data, word->len + 1);
+    }
+
+    return token->rc;
+}
+
+
+/* Reads the body of the block directive being handled, up to its closing
+ * brace, to be replayed by ngx_conf_parse() between
+ * ngx_conf_script_loop_enter() and ngx_conf_script_loop_leave(). The body
+ * is read once, whatever the number of replays. */
+
+ngx_int_t
+ngx_conf_script_loop_read(ngx_conf_t *cf, ngx_conf_script_loop_t **loop)
+{
+    ngx_conf_script_loop_t  *body;
+
+    body = ngx_pcalloc(cf->temp_pool, sizeof(ngx_conf_script_loop_t));
+    if (body == NULL
+        || ngx_array_init(&body->tokens, cf->temp_pool, 16,
+                          sizeof(ngx_conf_script_token_t))
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_conf_script_block_read(cf, &body->tokens) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    *loop = body;
+
+    return NGX_OK;
+}
+
+
+/* Reads the body of the block directive being handled, without running
+ * nor expanding anything, and closes the block. */
+
+ngx_int_t
+ngx_conf_script_block_skip(ngx_conf_t *cf)
+{
+    if (ngx_conf_script_block_read(cf, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_conf_script_block_done(cf);
+
+    return NGX_OK;
+}
+
+
+/* Reads tokens up to the brace closing the current block, keeping them in
+ * tokens if not NULL. */
+
+ngx_int_t
+ngx_conf_script_block_read(ngx_conf_t *cf, ngx_array_t *tokens)
+{
+    ngx_int_t                rc;
+    ngx_uint_t               depth;
+    ngx_conf_script_ctx_t   *ctx;
+
+    ctx = cf->cycle->conf_script;
+
+    if (ctx == NULL || ctx->file == NULL || ctx->read_token == NULL
+        || ctx->file->conf_file != cf->conf_file)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "block can not be read ahead: nginx lacks the "
+                           "ngx_conf_script_read_token patch");
+        return NGX_ERROR;
+    }
+
+    for (depth = 0; /* void */; /* void */) {
+        rc = ngx_conf_script_read_token(cf, ctx->read_token);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_CONF_FILE_DONE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unexpected end of file, expecting \"}\"");
+            return NGX_ERROR;
+        }
+
+        if (tokens
+            && ngx_conf_script_token_copy(cf->temp_pool, cf, rc, tokens)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_CONF_BLOCK_START) {
+            ++depth;
+
+        } else if (rc == NGX_CONF_BLOCK_DONE && depth-- == 0) {
+            return NGX_OK;
+        }
+    }
+}
+
+
+/* Notes whether the static_if just done took its block, for a static_else
+ * right after it. */
+
+void
+ngx_conf_script_branch(ngx_conf_t *cf, ngx_uint_t taken)
+{
+    ngx_conf_script_ctx_t  *ctx;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+
+    ctx->branch = ctx->ntokens;
+    ctx->branch_taken = taken ? 1 : 0;
+}
+
+
+/* NGX_OK if a static_else is to take its block, NGX_DECLINED if not. */
+
+ngx_int_t
+ngx_conf_script_branch_else(ngx_conf_t *cf)
+{
+    ngx_conf_script_ctx_t  *ctx;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+
+    /* static_else is the very token after the static_if's block */
+    if (ctx->branch == 0 || ctx->ntokens != ctx->branch + 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"static_else\" does not follow a "
+                           "\"static_if\" block");
+        return NGX_ERROR;
+    }
+
+    ctx->branch = 0;
+
+    return ctx->branch_taken ? NGX_DECLINED : NGX_OK;
+}
+
+
+void
+ngx_conf_script_loop_enter(ngx_conf_t *cf, ngx_conf_script_loop_t *loop)
+{
+    ngx_conf_script_file_t  *file;
+
+    file = ngx_conf_script_get_ctx(cf)->file;
+
+    loop->prev = file->loop;
+    loop->next_token = 0;
+    file->loop = loop;
+}
+
+
+void
+ngx_conf_script_loop_leave(ngx_conf_t *cf, ngx_conf_script_loop_t *loop)
+{
+    ngx_conf_script_get_ctx(cf)->file->loop = loop->prev;
+}
+
+
+ngx_int_t
+ngx_conf_script_loop_replay(ngx_conf_t *cf, ngx_conf_script_loop_t *loop)
+{
+    ngx_conf_script_token_t  *token;
+
+    /* only a parser reading past the closing brace gets there */
+    if (loop->next_token == loop->tokens.nelts) {
+        return NGX_CONF_FILE_DONE;
+    }
+
+    token = loop->tokens.elts;
+
+    return ngx_conf_script_token_replay(cf, &token[loop->next_token++]);
+}
+
+
+/* Replaces ngx_read_file() when the parser fills its buffer, serving the
+ * file from memory if a prefetch thread already read it. */
+
+ssize_t
+ngx_conf_script_read_file(ngx_conf_t *cf, u_char *buf, size_t size,
+    off_t offset)
+{
+#if (NGX_THREADS)
+    ngx_conf_script_ctx_t    *ctx;
+    ngx_conf_script_fetch_t  *fetch;
+
+    ctx = cf->cycle->conf_script;
+
+    if (ctx && ctx->file && ctx->file->conf_file == cf->conf_file
+        && ctx->file->fetch)
+    {
+        fetch = ctx->file->fetch;
+        if ((size_t) offset + size <= fetch->size) {
+            ngx_memcpy(buf, fetch->data + offset, size);
+            cf->conf_file->file.offset += size;
+            return size;
+        }
+    }
+#endif
+
+    return ngx_read_file(&cf->conf_file->file, buf, size, offset);
+}
+
+
+/* Starts threads reading included files ahead of the parser. */
+
+ngx_int_t
+ngx_conf_script_prefetch(ngx_conf_t *cf, ngx_uint_t threads)
+{
+#if (NGX_THREADS)
+    int                          err;
+    off_t                        start, size, offset;
+    u_char                      *data;
+    ssize_t                      n;
+    ngx_uint_t                   i;
+    sigset_t                     set, old;
+    ngx_file_t                  *file;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_prefetch_t  *pf;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->prefetch) {
+        return NGX_DECLINED;
+    }
+
+    pf = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_prefetch_t));
+    if (pf == NULL) {
+        return NGX_ERROR;
+    }
+
+    pf->tids = ngx_palloc(ctx->pool, threads * sizeof(pthread_t));
+    if (pf->tids == NULL
+        || ngx_conf_script_hash_init(&pf->files, ctx->pool, 64) != NGX_OK
+        || ngx_conf_script_hash_init(&pf->globs, ctx->pool, 16) != NGX_OK
+        || ngx_thread_mutex_create(&pf->mtx, cf->log) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_cond_create(&pf->queued, cf->log) != NGX_OK
+        || ngx_thread_cond_create(&pf->done, cf->log) != NGX_OK)
+    {
+        (void) ngx_thread_mutex_destroy(&pf->mtx, cf->log);
+        return NGX_ERROR;
+    }
+
+    pf->tail = &pf->head;
+    pf->log = ctx->log;
+    ctx->prefetch = pf;
+
+    /* The threads only read files: signals stay with the master. */
+    sigfillset(&set);
+    (void) pthread_sigmask(SIG_SETMASK, &set, &old);
+
+    for (i = 0; i < threads; ++i) {
+        err = pthread_create(&pf->tids[i], NULL,
+                             ngx_conf_script_prefetch_thread, pf);
+        if (err) {
+            ngx_log_error(NGX_LOG_WARN, cf->log, err,
+                          "pthread_create() failed, prefetching config "
+                          "files with %ui threads", i);
+            break;
+        }
+        ++pf->nthreads;
+    }
+
+    (void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* the includes left in this file, which nobody will prefetch */
+
+    if (pf->nthreads == 0 || cf->conf_file->buffer == NULL
+        || (ctx->file && ctx->file->conf_file == cf->conf_file
+            && (ctx->file->replay || ctx->file->fetch)))
+    {
+        return NGX_OK;
+    }
+
+    file = &cf->conf_file->file;
+    start = file->offset - (cf->conf_file->buffer->last
+                            - cf->conf_file->buffer->pos);
+    size = ngx_file_size(&file->info) - start;
+
+    if (start < 0 || size <= 0) {
+        return NGX_OK;
+    }
+
+    data = ngx_pnalloc(cf->temp_pool, size);
+    if (data == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = file->offset;
+    n = ngx_read_file(file, data, size, start);
+    file->offset = offset;
+
+    if (n == NGX_ERROR) {
+        return NGX_OK;
+    }
+
+    return ngx_conf_script_prefetch_scan(cf, data, data + n);
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "config files prefetch requires threads support");
+    return NGX_ERROR;
+#endif
+}
+
+
+/* Called by a glob include before it parses its matches: queues them,
+ * unless the prefetch scan already did when the include was read ahead.
+ * Errors are left for the include to report. */
+
+ngx_int_t
+ngx_conf_script_prefetch_glob(ngx_conf_t *cf, ngx_str_t *pattern)
+{
+#if (NGX_THREADS)
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    ctx = cf->cycle->conf_script;
+    if (ctx == NULL || ctx->prefetch == NULL
+        || ctx->prefetch->nthreads == 0)
+    {
+        return NGX_OK;
+    }
+
+    elt = ngx_conf_script_hash_find(&ctx->prefetch->globs,
+                                    ngx_hash_key(pattern->data, pattern->len),
+                                    pattern->data, pattern->len);
+    if (elt && elt->value) {
+        elt->value = NULL;
+        return NGX_OK;
+    }
+
+    return ngx_conf_script_prefetch_matches(ctx, cf, pattern);
+#else
+    return NGX_OK;
+#endif
+}
+
+
+#if (NGX_THREADS)
+
+/* Queues the files a glob pattern matches, in the order the include will
+ * parse them. */
+
+ngx_int_t
+ngx_conf_script_prefetch_matches(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *pattern)
+{
+    ngx_str_t   name;
+    ngx_glob_t  gl;
+
+    ngx_memzero(&gl, sizeof(ngx_glob_t));
+
+    gl.pattern = pattern->data;
+    gl.log = cf->log;
+    gl.test = 1;
+
+    if (ngx_open_glob(&gl) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    while (ngx_read_glob(&gl, &name) == NGX_OK) {
+        if (ngx_conf_script_prefetch_add(ctx, &name) != NGX_OK) {
+            ngx_close_glob(&gl);
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_close_glob(&gl);
+
+    return NGX_OK;
+}
+
+
+/* Queues, ahead of the parser, the files named by the include directives
+ * of a file's text. This is only a rough tokenizer: it follows comments,
+ * quotes and conf_scripts delimiters, and leaves out includes with a
+ * script or an escape in their argument, since their value is only known
+ * once the parser gets there. A wrong guess costs a read, or a file the
+ * parser reads itself. */
+
+ngx_int_t
+ngx_conf_script_prefetch_scan(ngx_conf_t *cf, u_char *p, u_char *last)
+{
+    u_char      quote;
+    ngx_str_t   word[3], open;
+    ngx_uint_t  n;
+
+    open.len = 0;
+    if (cf->conf_file->script_delim) {
+        open = cf->conf_file->script_delim->open;
+    }
+
+    n = 0;
+
+    while (p < last) {
+
+        switch (*p) {
+
+        case ' ': case '\t': case CR: case LF:
+            ++p;
+            continue;
+
+        case '#':
+            while (p < last && *p != LF) {
+                ++p;
+            }
+            continue;
+
+        case ';':
+            if (n == 2 && word[0].len == sizeof("include") - 1
+                && ngx_strncmp(word[0].data, "include", word[0].len) == 0
+                && ngx_conf_script_prefetch_include(cf, &word[1], &open)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            if ((n == 2 || n == 3)
+                && word[0].len == sizeof("conf_scripts") - 1
+                && ngx_strncmp(word[0].data, "conf_scripts", word[0].len)
+                   == 0)
+            {
+                if (n == 3) {
+                    open = word[1];
+                } else if (n == 2) {
+                    open.len = 0;
+                }
+            }
+
+            /* fall through */
+
+        case '{': case '}':
+            ++p;
+            n = 0;
+            continue;
+        }
+
+        if (*p == '"' || *p == '\'') {
+            quote = *p++;
+            word[n < 3 ? n : 2].data = p;
+            while (p < last && *p != quote) {
+                p += (*p == '\\') ? 2 : 1;
+            }
+            if (p > last) {
+                p = last;
+            }
+            word[n < 3 ? n : 2].len = p - word[n < 3 ? n : 2].data;
+            ++p;
+
+        } else {
+            word[n < 3 ? n : 2].data = p;
+            while (p < last && *p != ' ' && *p != '\t' && *p != CR
+                   && *p != LF && *p != ';' && *p != '{' && *p != '}')
+            {
+                ++p;
+            }
+            word[n < 3 ? n : 2].len = p - word[n < 3 ? n : 2].data;
+        }
+
+        ++n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_conf_script_prefetch_include(ngx_conf_t *cf, ngx_str_t *arg,
+    ngx_str_t *open)
+{
+    ngx_str_t                    name;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    if (arg->len == 0
+        || ngx_strlchr(arg->data, arg->data + arg->len, '\\')
+        || (open->len
+            && ngx_conf_script_find_delim(arg->data, arg->data + arg->len,
+                                          open)))
+    {
+        return NGX_OK;
+    }
+
+    name.len = arg->len;
+    name.data = ngx_pnalloc(cf->temp_pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_cpystrn(name.data, arg->data, name.len + 1);
+
+    if (ngx_conf_full_name(cf->cycle, &name, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx = cf->cycle->conf_script;
+
+    if (strpbrk((char *) name.data, "*?[") == NULL) {
+        return ngx_conf_script_prefetch_add(ctx, &name);
+    }
+
+    /* for the include not to glob them again */
+    elt = ngx_conf_script_hash_add(&ctx->prefetch->globs,
+                                   ngx_hash_key(name.data, name.len),
+                                   name.data, name.len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+    elt->value = ctx->prefetch;
+
+    return ngx_conf_script_prefetch_matches(ctx, cf, &name);
+}
+
+
+ngx_int_t
+ngx_conf_script_prefetch_add(ngx_conf_script_ctx_t *ctx, ngx_str_t *name)
+{
+    ngx_conf_script_prefetch_t  *pf;
+    ngx_conf_script_fetch_t     *fetch;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    pf = ctx->prefetch;
+
+    elt = ngx_conf_script_hash_add(&pf->files,
+                                   ngx_hash_key(name->data, name->len),
+                                   name->data, name->len);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    fetch = elt->value;
+
+    if (fetch == NULL) {
+        fetch = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_fetch_t));
+        if (fetch == NULL) {
+            return NGX_ERROR;
+        }
+        fetch->name = ngx_pnalloc(ctx->pool, name->len + 1);
+        if (fetch->name == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_cpystrn(fetch->name, name->data, name->len + 1);
+        fetch->state = NGX_CONF_SCRIPT_FETCH_TAKEN;
+        elt->value = fetch;
+    }
+
+    if (ngx_thread_mutex_lock(&pf->mtx, pf->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* already on its way, waiting for the parser, or being parsed */
+    if (fetch->state != NGX_CONF_SCRIPT_FETCH_TAKEN || fetch->data) {
+        return ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+    }
+
+    fetch->state = NGX_CONF_SCRIPT_FETCH_QUEUED;
+    if (!fetch->linked) {
+        fetch->linked = 1;
+        fetch->next = NULL;
+        *pf->tail = fetch;
+        pf->tail = &fetch->next;
+    }
+    ++pf->queued_files;
+
+    (void) ngx_thread_cond_signal(&pf->queued, pf->log);
+
+    return ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+}
+
+
+/* Hands the parser what was read of the file it just opened, if it still
+ * is the same file. A file nobody started reading yet is dropped from the
+ * queue, for the parser to read it itself rather than wait. */
+
+ngx_conf_script_fetch_t *
+ngx_conf_script_prefetch_take(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_file_t *conf_file)
+{
+    ngx_str_t                   *name;
+    ngx_conf_script_prefetch_t  *pf;
+    ngx_conf_script_fetch_t     *fetch;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    pf = ctx->prefetch;
+    name = &conf_file->file.name;
+
+    elt = ngx_conf_script_hash_find(&pf->files,
+                                    ngx_hash_key(name->data, name->len),
+                                    name->data, name->len);
+    if (elt == NULL) {
+        return NULL;
+    }
+
+    fetch = elt->value;
+
+    if (ngx_thread_mutex_lock(&pf->mtx, pf->log) != NGX_OK) {
+        return NULL;
+    }
+
+    if (fetch->state == NGX_CONF_SCRIPT_FETCH_TAKEN) {
+        (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+        return NULL;
+    }
+
+    while (fetch->state == NGX_CONF_SCRIPT_FETCH_READING) {
+        if (ngx_thread_cond_wait(&pf->done, &pf->mtx, pf->log) != NGX_OK) {
+            (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+            return NULL;
+        }
+    }
+
+    if (fetch->state == NGX_CONF_SCRIPT_FETCH_QUEUED) {
+        fetch->state = NGX_CONF_SCRIPT_FETCH_TAKEN;
+        (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+        return NULL;
+    }
+
+    fetch->state = NGX_CONF_SCRIPT_FETCH_TAKEN;
+
+    (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+
+    if (fetch->data == NULL
+        || ngx_file_uniq(&fetch->info) != ngx_file_uniq(&conf_file->file.info)
+        || ngx_file_size(&fetch->info) != ngx_file_size(&conf_file->file.info)
+        || ngx_file_mtime(&fetch->info)
+           != ngx_file_mtime(&conf_file->file.info))
+    {
+        ngx_conf_script_prefetch_release(fetch);
+        return NULL;
+    }
+
+    ++pf->hits;
+
+    return fetch;
+}
+
+
+void
+ngx_conf_script_prefetch_release(ngx_conf_script_fetch_t *fetch)
+{
+    if (fetch->data) {
+        ngx_free(fetch->data);
+        fetch->data = NULL;
+    }
+    fetch->size = 0;
+}
+
+
+void *
+ngx_conf_script_prefetch_thread(void *data)
+{
+    ngx_conf_script_prefetch_t  *pf = data;
+
+    ngx_conf_script_fetch_t  *fetch;
+
+    if (ngx_thread_mutex_lock(&pf->mtx, pf->log) != NGX_OK) {
+        return NULL;
+    }
+
+    for ( ;; ) {
+        while (pf->head == NULL && !pf->stop) {
+            if (ngx_thread_cond_wait(&pf->queued, &pf->mtx, pf->log)
+                != NGX_OK)
+            {
+                (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+                return NULL;
+            }
+        }
+
+        if (pf->stop) {
+            /* pass it on to the next thread */
+            (void) ngx_thread_cond_signal(&pf->queued, pf->log);
+            (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+            return NULL;
+        }
+
+        fetch = pf->head;
+        pf->head = fetch->next;
+        if (pf->head == NULL) {
+            pf->tail = &pf->head;
+        }
+        fetch->linked = 0;
+
+        if (fetch->state != NGX_CONF_SCRIPT_FETCH_QUEUED) {
+            continue;
+        }
+
+        fetch->state = NGX_CONF_SCRIPT_FETCH_READING;
+
+        (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+
+        ngx_conf_script_prefetch_read(fetch, pf->log);
+
+        if (ngx_thread_mutex_lock(&pf->mtx, pf->log) != NGX_OK) {
+            return NULL;
+        }
+
+        fetch->state = NGX_CONF_SCRIPT_FETCH_DONE;
+        (void) ngx_thread_cond_signal(&pf->done, pf->log);
+    }
+}
+
+
+/* Runs in a prefetch thread: nothing here may touch the pools. */
+
+void
+ngx_conf_script_prefetch_read(ngx_conf_script_fetch_t *fetch, ngx_log_t *log)
+{
+    u_char    *data;
+    size_t     size, done;
+    ssize_t    n;
+    ngx_fd_t   fd;
+
+    fd = ngx_open_file(fetch->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fetch->info) == NGX_FILE_ERROR) {
+        goto close;
+    }
+
+    size = ngx_file_size(&fetch->info);
+
+    data = ngx_alloc(size ? size : 1, log);
+    if (data == NULL) {
+        goto close;
+    }
+
+    for (done = 0; done < size; done += n) {
+        n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            ngx_free(data);
+            goto close;
+        }
+    }
+
+    fetch->data = data;
+    fetch->size = size;
+
+close:
+
+    (void) ngx_close_file(fd);
+}
+
+
+void
+ngx_conf_script_prefetch_stop(ngx_conf_script_ctx_t *ctx)
+{
+    ngx_uint_t                   i;
+    ngx_conf_script_prefetch_t  *pf;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    pf = ctx->prefetch;
+
+    if (ngx_thread_mutex_lock(&pf->mtx, pf->log) == NGX_OK) {
+        pf->stop = 1;
+        (void) ngx_thread_cond_signal(&pf->queued, pf->log);
+        (void) ngx_thread_mutex_unlock(&pf->mtx, pf->log);
+    }
+
+    for (i = 0; i < pf->nthreads; ++i) {
+        (void) pthread_join(pf->tids[i], NULL);
+    }
+
+    for (i = 0; i < pf->files.size; ++i) {
+        for (elt = pf->files.buckets[i]; elt; elt = elt->next) {
+            ngx_conf_script_prefetch_release(elt->value);
+        }
+    }
+
+    (void) ngx_thread_cond_destroy(&pf->queued, pf->log);
+    (void) ngx_thread_cond_destroy(&pf->done, pf->log);
+    (void) ngx_thread_mutex_destroy(&pf->mtx, pf->log);
+
+    ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                  "conf_scripts: %ui config files queued for prefetch, "
+                  "%ui parsed from memory", pf->queued_files, pf->hits);
+
+    ctx->prefetch = NULL;
+}
+
+#endif
+
+
+/* Folding of constant rewrite sets: the sets of a variable, as long as they
+ * all give it the same constant. */
+
+ngx_int_t
+ngx_conf_script_fold(ngx_conf_t *cf, ngx_uint_t on)
+{
+    ngx_conf_script_ctx_t  *ctx;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (on && ctx->folds.buckets == NULL
+        && (ngx_conf_script_hash_init(&ctx->folds, ctx->pool, 64) != NGX_OK
+            || ngx_conf_script_hash_init(&ctx->writers, ctx->pool, 64)
+               != NGX_OK))
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->fold = on;
+
+    return NGX_OK;
+}
+
+
+/* Counts a directive that may write the variable called name at run time:
+ * a set, a regex capture, an auth_request_set... */
+
+ngx_int_t
+ngx_conf_script_fold_writer(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    ctx = cf->cycle->conf_script;
+
+    if (ctx == NULL || !ctx->fold) {
+        return NGX_OK;
+    }
+
+    elt = ngx_conf_script_fold_writers(ctx, name, 1);
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    elt->value = (void *) ((uintptr_t) elt->value + 1);
+
+    return NGX_OK;
+}
+
+
+/* Finds (or adds) the count of name's writers, by its lowercase name as
+ * nginx matches variables. */
+
+ngx_conf_script_hash_elt_t *
+ngx_conf_script_fold_writers(ngx_conf_script_ctx_t *ctx, ngx_str_t *name,
+    ngx_uint_t add)
+{
+    u_char                      *low;
+    ngx_uint_t                   i, key;
+    ngx_conf_script_mark_t       mark;
+    ngx_conf_script_hash_elt_t  *elt;
+
+    ngx_conf_script_mark(ctx, &mark);
+
+    low = ngx_conf_script_alloc(ctx, name->len);
+    if (low == NULL) {
+        ngx_conf_script_release(ctx, &mark);
+        return NULL;
+    }
+
+    for (i = 0, key = 0; i < name->len; ++i) {
+        low[i] = ngx_tolower(name->data[i]);
+        key = ngx_hash(key, low[i]);
+    }
+
+    elt = add ? ngx_conf_script_hash_add(&ctx->writers, key, low, name->len)
+              : ngx_conf_script_hash_find(&ctx->writers, key, low, name->len);
+
+    ngx_conf_script_release(ctx, &mark);
+
+    return elt;
+}
+
+
+/* Records a set of var, called name, whose codes start at offset in codes;
+ * value is NULL if the set can not be folded (not a constant, or
+ * conditional). */
+
+ngx_int_t
+ngx_conf_script_fold_set(ngx_conf_t *cf, void *var, ngx_str_t *name,
+    ngx_str_t *value, ngx_array_t *codes, ngx_uint_t offset)
+{
+    ngx_uint_t                   key;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_fold_t      *fold;
+    ngx_conf_script_hash_elt_t  *elt;
+    ngx_conf_script_set_code_t  *set;
+
+    ctx = cf->cycle->conf_script;
+
+    if (ctx == NULL || !ctx->fold) {
+        return NGX_OK;
+    }
+
+    ++ctx->sets;
+
+    key = ngx_hash_key((u_char *) &var, sizeof(void *));
+
+    elt = ngx_conf_script_hash_add(&ctx->folds, key, (u_char *) &var,
+                                   sizeof(void *));
+    if (elt == NULL) {
+        return NGX_ERROR;
+    }
+
+    fold = elt->value;
+
+    if (fold == NULL) {
+        fold = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_fold_t));
+        if (fold == NULL
+            || ngx_array_init(&fold->sets, ctx->pool, 2,
+                              sizeof(ngx_conf_script_set_code_t))
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        fold->var = var;
+        fold->name = *name;
+        elt->value = fold;
+    }
+
+    if (fold->unfoldable) {
+        return NGX_OK;
+    }
+
+    if (value == NULL
+        || (fold->value
+            && (fold->value->len != value->len
+                || ngx_memcmp(fold->value->data, value->data, value->len)
+                   != 0)))
+    {
+        fold->unfoldable = 1;
+        return NGX_OK;
+    }
+
+    if (fold->value == NULL) {
+        /* for the next sets to be compared with */
+        fold->value = ngx_palloc(ctx->pool, sizeof(ngx_str_t));
+        if (fold->value == NULL) {
+            return NGX_ERROR;
+        }
+        *fold->value = *value;
+    }
+
+    set = ngx_array_push(&fold->sets);
+    if (set == NULL) {
+        return NGX_ERROR;
+    }
+    set->codes = codes;
+    set->offset = offset;
+
+    return NGX_OK;
+}
+
+
+/* Once all sets are known, hands those of each foldable variable to fold. */
+
+ngx_int_t
+ngx_conf_script_fold_sets(ngx_conf_t *cf, ngx_conf_script_fold_pt fold)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_conf_script_ctx_t       *ctx;
+    ngx_conf_script_fold_t      *f;
+    ngx_conf_script_hash_elt_t  *elt, *w;
+
+    ctx = cf->cycle->conf_script;
+
+    if (ctx == NULL || !ctx->fold) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < ctx->folds.size; ++i) {
+        for (elt = ctx->folds.buckets[i]; elt; elt = elt->next) {
+            f = elt->value;
+
+            if (f->unfoldable) {
+                continue;
+            }
+
+            /* its sets must be its only writers */
+
+            w = ngx_conf_script_fold_writers(ctx, &f->name, 0);
+
+            if (w == NULL || (uintptr_t) w->value != f->sets.nelts) {
+                continue;
+            }
+
+            rc = fold(cf, f->var, &f->sets);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc != NGX_DECLINED) {
+                ctx->sets_folded += f->sets.nelts;
+                ctx->sets_dropped += (ngx_uint_t) rc;
+            }
+        }
+    }
+
+    /* another http block has variables of its own */
+
+    if (ngx_conf_script_hash_init(&ctx->writers, ctx->pool, 64) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_conf_script_hash_init(&ctx->folds, ctx->pool, 64);
+}
+
+
+/* Turns profiling on (or off) for the rest of the configuration load. */
+
+ngx_int_t
+ngx_conf_script_stats(ngx_conf_t *cf, ngx_uint_t on)
+{
+    ngx_conf_script_ctx_t  *ctx;
+
+    ctx = ngx_conf_script_get_ctx(cf);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (on && ctx->file_stats.buckets == NULL) {
+        if (ngx_conf_script_hash_init(&ctx->file_stats, ctx->pool, 32)
+            != NGX_OK
+            || ngx_conf_script_hash_init(&ctx->directive_stats, ctx->pool, 32)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->stats = on;
+
+    return NGX_OK;
+}
+
+
+/* Runs ngx_conf_ccv_expand(), and attributes what it did to the current
+ * file and directive. Only outermost expansions come here: the defines
+ * they expand are counted as part of them, not again on their own. */
+
+int
+ngx_conf_script_profile(ngx_conf_script_ctx_t *ctx, ngx_conf_t *cf,
+    ngx_str_t *string)
+{
+    int                       rc;
+    ngx_uint_t                i;
+    ngx_str_t                *directive;
+    struct timeval            start, end;
+    ngx_conf_script_stats_t   before, *stats[2];
+
+    stats[0] = NULL;
+    if (ctx->file && ctx->file->conf_file == cf->conf_file) {
+        if (ctx->file->stats == NULL) {
+            ctx->file->stats = ngx_conf_script_stats_get(ctx,
+                                   &ctx->file_stats,
+                                   &cf->conf_file->file.name);
+        }
+        stats[0] = ctx->file->stats;
+    }
+
+    stats[1] = NULL;
+    if (cf->args && cf->args->nelts) {
+        directive = cf->args->elts;
+        stats[1] = ngx_conf_script_stats_get(ctx, &ctx->directive_stats,
+                                             &directive[0]);
+    }
+
+    before = ctx->total;
+    ctx->total.max_depth = 0;
+
+    ngx_gettimeofday(&start);
+    rc = ngx_conf_ccv_expand(cf, string);
+    ngx_gettimeofday(&end);
+
+    ctx->total.usec += (end.tv_sec - start.tv_sec) * 1000000
+                       + end.tv_usec - start.tv_usec;
+
+    for (i = 0; i < 2; ++i) {
+        if (stats[i] == NULL) {
+            continue;
+        }
+        ++stats[i]->calls;
+        stats[i]->expanded += ctx->total.expanded - before.expanded;
+        stats[i]->exprs += ctx->total.exprs - before.exprs;
+        stats[i]->lookups += ctx->total.lookups - before.lookups;
+        stats[i]->depth += ctx->total.depth - before.depth;
+        stats[i]->usec += ctx->total.usec - before.usec;
+        stats[i]->bytes += ctx->total.bytes - before.bytes;
+        if (ctx->total.max_depth > stats[i]->max_depth) {
+            stats[i]->max_depth = ctx->total.max_depth;
+        }
+    }
+
+    if (before.max_depth > ctx->total.max_depth) {
+        ctx->total.max_depth = before.max_depth;
+    }
+
+    return rc;
+}
+
+
+ngx_conf_script_stats_t *
+ngx_conf_script_stats_get(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_hash_t *hash, ngx_str_t *name)
+{
+    ngx_conf_script_hash_elt_t  *elt;
+
+    elt = ngx_conf_script_hash_add(hash, ngx_hash_key(name->data, name->len),
+                                   name->data, name->len);
+    if (elt == NULL) {
+        return NULL;
+    }
+
+    if (elt->value == NULL) {
+        elt->value = ngx_pcalloc(ctx->pool, sizeof(ngx_conf_script_stats_t));
+    }
+
+    return elt->value;
+}
+
+
+/* Logs a summary, heaviest files and directives first. */
+
+void
+ngx_conf_script_stats_report(ngx_conf_script_ctx_t *ctx)
+{
+    uint64_t                      parse;
+    ngx_uint_t                    i, n, h;
+    struct timeval                end;
+    ngx_conf_script_hash_t       *hashes[2];
+    ngx_conf_script_hash_elt_t   *elt, **elts;
+    static const char            *what[2] = { "file", "directive" };
+
+    ngx_gettimeofday(&end);
+
+    parse = (end.tv_sec - ctx->start.tv_sec) * 1000000
+            + end.tv_usec - ctx->start.tv_usec;
+
+    ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                  "conf_scripts stats: %uL.%03uL ms of scripts "
+                  "in %uL.%03uL ms of parsing",
+                  ctx->total.usec / 1000, ctx->total.usec % 1000,
+                  parse / 1000, parse % 1000);
+    ngx_conf_script_stats_log(ctx, "total", NULL, &ctx->total);
+    ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                  "conf_scripts stats: %ui expressions compiled, "
+                  "%ui cache hits, %uz bytes of scratch at peak",
+                  ctx->prog_misses, ctx->prog_hits, ctx->arena_peak);
+
+    hashes[0] = &ctx->file_stats;
+    hashes[1] = &ctx->directive_stats;
+
+    for (h = 0; h < 2; ++h) {
+        elts = ngx_palloc(ctx->pool,
+                          hashes[h]->nelts * sizeof(ngx_conf_script_hash_elt_t *));
+        if (elts == NULL) {
+            return;
+        }
+
+        for (i = 0, n = 0; i < hashes[h]->size; ++i) {
+            for (elt = hashes[h]->buckets[i]; elt; elt = elt->next) {
+                if (elt->value) {
+                    elts[n++] = elt;
+                }
+            }
+        }
+
+        ngx_qsort(elts, n, sizeof(ngx_conf_script_hash_elt_t *),
+                  ngx_conf_script_stats_cmp);
+
+        for (i = 0; i < n; ++i) {
+            ngx_conf_script_stats_log(ctx, what[h], &elts[i]->name,
+                                      elts[i]->value);
+        }
+    }
+}
+
+
+void
+ngx_conf_script_stats_log(ngx_conf_script_ctx_t *ctx, const char *what,
+    ngx_str_t *name, ngx_conf_script_stats_t *stats)
+{
+    u_char  *p, label[1024];
+
+    if (name) {
+        p = ngx_snprintf(label, sizeof(label), "%s \"%V\"", what, name);
+    } else {
+        p = ngx_snprintf(label, sizeof(label), "%s", what);
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                  "conf_scripts stats: %*s: "
+                  "calls:%ui expanded:%ui exprs:%ui lookups:%ui "
+                  "depth:%ui/%ui usec:%uL bytes:%uz",
+                  p - label, label,
+                  stats->calls, stats->expanded, stats->exprs,
+                  stats->lookups, stats->depth, stats->max_depth,
+                  stats->usec, stats->bytes);
+}
+
+
+int
+ngx_conf_script_stats_cmp(const void *one, const void *two)
+{
+    ngx_conf_script_stats_t  *a, *b;
+
+    a = (*(ngx_conf_script_hash_elt_t **) one)->value;
+    b = (*(ngx_conf_script_hash_elt_t **) two)->value;
+
+    return a->usec < b->usec ? 1 : (a->usec > b->usec ? -1 : 0);
+}
+
+
+void
+ngx_conf_script_block_start(ngx_conf_t *cf)
+{
+    ++cf->cycle->conf_block_level;
+}
+
+
+void
+ngx_conf_script_block_done(ngx_conf_t *cf)
+{
+    --cf->cycle->conf_block_level;
+
+    /* A block has at most one scope, holding all of its parents' variables:
+     * dropping it is all it takes. Its map stays in the temp pool, where
+     * nodes shared with the parent's belong to the parent. */
+    if (cf->vars && cf->vars->block_level > cf->cycle->conf_block_level) {
         cf->vars = cf->vars->next;
-        /* Do not clean array_destroy(&vars->vars) nor free(vars).
-         * Having been allocated on the cf's temp pool, they may have
-         * been reused now. */
     }
 }
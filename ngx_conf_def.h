@@ -19,32 +19,193 @@ typedef struct {
 } ngx_conf_script_delim_t;
 
 
+typedef struct ngx_conf_script_ctx_s  ngx_conf_script_ctx_t;
+typedef struct ngx_conf_script_store_s  ngx_conf_script_store_t;
+typedef struct ngx_conf_script_loop_s  ngx_conf_script_loop_t;
+
+
+/* Scratch memory for evaluations, released in stack order. */
+typedef struct ngx_conf_script_arena_block_s  ngx_conf_script_arena_block_t;
+
+typedef struct {
+    ngx_conf_script_arena_block_t  *block;
+    u_char                         *pos;
+    size_t                          used;
+} ngx_conf_script_mark_t;
+
+
+typedef struct ngx_conf_script_hash_elt_s  ngx_conf_script_hash_elt_t;
+
+struct ngx_conf_script_hash_elt_s {
+    ngx_conf_script_hash_elt_t  *next;
+    ngx_uint_t                   key;
+    ngx_str_t                    name;
+    void                        *value;
+};
+
+typedef struct {
+    ngx_conf_script_hash_elt_t **buckets;
+    ngx_uint_t                   size;
+    ngx_uint_t                   nelts;
+    ngx_pool_t                  *pool;
+} ngx_conf_script_hash_t;
+
+
+/* A define's value, left unexpanded until referenced, and its last
+ * expansion along with the values of the variables it read. */
+typedef struct ngx_conf_script_define_s  ngx_conf_script_define_t;
+
+struct ngx_conf_script_define_s {
+    ngx_str_t                  value;
+    ngx_conf_script_delim_t    delim; /* the marks where it was defined */
+    ngx_str_t                  dir;   /* ., there */
+    ngx_conf_script_define_t  *prev;  /* define being expanded around us */
+    ngx_str_t                  result;
+    ngx_array_t                deps;
+    unsigned                   busy:1;
+    unsigned                   expanded:1;
+};
+
+
 typedef struct {
+    ngx_uint_t sym;
+    ngx_uint_t block_level; /* of the scope that set it */
     ngx_str_t name;
     ngx_str_t val;
+    ngx_conf_script_define_t *define; /* val is then its expansion */
 } ngx_conf_script_var_t;
 
 
+/* A block level's variables, along with those of its parents: a 32-way trie
+ * on symbol ids, sharing the nodes it has not changed with its parent's. */
+typedef struct ngx_conf_script_map_s  ngx_conf_script_map_t;
+
 typedef struct ngx_conf_script_vars {
-    ngx_array_t vars;
+    ngx_conf_script_map_t *map;
+    ngx_uint_t shift; /* of the map's root level */
     ngx_uint_t block_level;
     struct ngx_conf_script_vars *next;
 } ngx_conf_script_vars_t;
 
 
-int ngx_conf_script_var_set(ngx_conf_script_vars_t *vars,
+ngx_conf_script_ctx_t *ngx_conf_script_get_ctx(ngx_conf_t *cf);
+
+void *ngx_conf_script_alloc(ngx_conf_script_ctx_t *ctx, size_t size);
+void ngx_conf_script_mark(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_mark_t *mark);
+void ngx_conf_script_release(ngx_conf_script_ctx_t *ctx,
+    ngx_conf_script_mark_t *mark);
+
+ngx_int_t ngx_conf_script_hash_init(ngx_conf_script_hash_t *hash,
+    ngx_pool_t *pool, ngx_uint_t size);
+ngx_conf_script_hash_elt_t *ngx_conf_script_hash_find(
+    ngx_conf_script_hash_t *hash, ngx_uint_t key, u_char *name, size_t len);
+ngx_conf_script_hash_elt_t *ngx_conf_script_hash_add(
+    ngx_conf_script_hash_t *hash, ngx_uint_t key, u_char *name, size_t len);
+
+ngx_int_t ngx_conf_script_sym(ngx_conf_script_ctx_t *ctx, ngx_str_t *name,
+    ngx_uint_t create);
+
+ngx_conf_script_vars_t *ngx_conf_script_vars_push(ngx_conf_t *cf);
+int ngx_conf_script_var_set(ngx_conf_t *cf, ngx_conf_script_vars_t *vars,
     ngx_str_t *name, ngx_str_t *val);
+int ngx_conf_script_var_define(ngx_conf_t *cf, ngx_conf_script_vars_t *vars,
+    ngx_str_t *name, ngx_str_t *value);
 int ngx_conf_complex_value(ngx_conf_t *cf, ngx_str_t *string);
+int ngx_conf_complex_value_shared(ngx_conf_t *cf, ngx_str_t *string);
+ngx_uint_t ngx_conf_script_true(ngx_str_t *value);
+
+/* A number, in bytes or milliseconds if it has a size or a time unit. */
+#define NGX_CONF_SCRIPT_NUM   0
+#define NGX_CONF_SCRIPT_SIZE  1
+#define NGX_CONF_SCRIPT_TIME  2
+#define NGX_CONF_SCRIPT_M     3  /* m: megabytes or minutes */
+#define NGX_CONF_SCRIPT_MM    4  /* M: megabytes or months */
+
+#define NGX_CONF_SCRIPT_NUM_LEN  (NGX_INT_T_LEN + 2)
+
+typedef struct {
+    ngx_int_t value;
+    ngx_uint_t unit;
+} ngx_conf_script_num_t;
+
+ngx_int_t ngx_conf_script_num(ngx_str_t *s, ngx_conf_script_num_t *num);
+ngx_int_t ngx_conf_script_num_unify(ngx_conf_script_num_t *a,
+    ngx_conf_script_num_t *b);
+u_char *ngx_conf_script_num_format(u_char *p, ngx_conf_script_num_t *num);
+
+ngx_int_t ngx_conf_script_file_start(ngx_conf_t *cf);
+void ngx_conf_script_file_done(ngx_conf_t *cf);
+ngx_int_t ngx_conf_script_stats(ngx_conf_t *cf, ngx_uint_t on);
+ngx_int_t ngx_conf_script_reuse(ngx_conf_t *cf, ngx_uint_t on);
+ngx_int_t ngx_conf_script_snapshot(ngx_conf_t *cf, ngx_str_t *name);
+
+/* Folding of constant rewrite sets: the patched rewrite module records each
+ * set, with a NULL value if it is not a constant, then calls
+ * ngx_conf_script_fold_sets() from its postconfiguration. The patched
+ * ngx_http_add_variable() counts all the directives that may write each
+ * variable. fold gets called with the sets of each variable whose sets all
+ * set the same value and are its only writers; it returns how many of them
+ * it dropped, the others being made constant, or NGX_DECLINED to keep the
+ * sets as they are. */
+typedef struct {
+    ngx_array_t             *codes;
+    ngx_uint_t               offset;
+} ngx_conf_script_set_code_t;
+
+typedef ngx_int_t (*ngx_conf_script_fold_pt)(ngx_conf_t *cf, void *var,
+    ngx_array_t *sets);
+
+ngx_int_t ngx_conf_script_fold(ngx_conf_t *cf, ngx_uint_t on);
+ngx_int_t ngx_conf_script_fold_writer(ngx_conf_t *cf, ngx_str_t *name);
+ngx_int_t ngx_conf_script_fold_set(ngx_conf_t *cf, void *var,
+    ngx_str_t *name, ngx_str_t *value, ngx_array_t *codes, ngx_uint_t offset);
+ngx_int_t ngx_conf_script_fold_sets(ngx_conf_t *cf,
+    ngx_conf_script_fold_pt fold);
+
+typedef ngx_int_t (*ngx_conf_script_read_token_pt)(ngx_conf_t *cf);
+
+ngx_int_t ngx_conf_script_read_token(ngx_conf_t *cf,
+    ngx_conf_script_read_token_pt read_token);
+
+ngx_int_t ngx_conf_script_loop_read(ngx_conf_t *cf,
+    ngx_conf_script_loop_t **loop);
+void ngx_conf_script_loop_enter(ngx_conf_t *cf, ngx_conf_script_loop_t *loop);
+void ngx_conf_script_loop_leave(ngx_conf_t *cf, ngx_conf_script_loop_t *loop);
+ngx_int_t ngx_conf_script_block_skip(ngx_conf_t *cf);
+void ngx_conf_script_branch(ngx_conf_t *cf, ngx_uint_t taken);
+ngx_int_t ngx_conf_script_branch_else(ngx_conf_t *cf);
+
+ngx_int_t ngx_conf_script_prefetch(ngx_conf_t *cf, ngx_uint_t threads);
+ngx_int_t ngx_conf_script_prefetch_glob(ngx_conf_t *cf, ngx_str_t *pattern);
+ssize_t ngx_conf_script_read_file(ngx_conf_t *cf, u_char *buf, size_t size,
+    off_t offset);
 
 void ngx_conf_script_block_start(ngx_conf_t *cf);
 void ngx_conf_script_block_done(ngx_conf_t *cf);
 
+/* A config script function. type tells how many arguments it takes, as
+ * NGX_CONF_NOARGS, NGX_CONF_TAKE1 to NGX_CONF_TAKE7, NGX_CONF_1MORE,
+ * NGX_CONF_2MORE or NGX_CONF_ANY would for a directive; it is checked when
+ * an expression calling the function gets compiled. func returns a string
+ * with a NULL data on error.
+ * A function flagged NGX_CONF_SCRIPT_PURE only depends on its arguments: it
+ * runs once per distinct arguments, at compile time if they are constant. */
+#define NGX_CONF_SCRIPT_PURE  0x00010000
+
 typedef struct {
     ngx_str_t             name;
     ngx_uint_t            type;
-    ngx_str_t             (*func)(int nargs, ngx_str_t *args);
+    ngx_str_t             (*func)(ngx_conf_t *cf, int nargs, ngx_str_t *args);
 } ngx_conf_script_func_t;
 extern ngx_conf_script_func_t *ngx_conf_script_functions;
 
+/* Makes a table of functions, terminated by a NULL func, callable from
+ * config scripts for the rest of the configuration load. Other modules can
+ * call it from any handler run before their functions get used, e.g. an
+ * http module's preconfiguration. */
+ngx_int_t ngx_conf_script_add_functions(ngx_conf_t *cf,
+    ngx_conf_script_func_t *funcs);
+
 
 #endif /* _NGX_CONF_DEF_H_INCLUDED_ */
@@ -5,7 +5,7 @@ static ngx_str_t dot = ngx_string(".");
 
 
 ngx_str_t
-ncs_dirname(int nargs, ngx_str_t *args)
+ncs_dirname(ngx_conf_t *cf, int nargs, ngx_str_t *args)
 {
     int end;
 
@@ -26,10 +26,14 @@ ncs_dirname(int nargs, ngx_str_t *args)
 
 
 ngx_str_t
-ncs_basename(int nargs, ngx_str_t *args)
+ncs_basename(ngx_conf_t *cf, int nargs, ngx_str_t *args)
 {
     int start, end;
 
+    if (args[0].len == 0) {
+        return args[0];
+    }
+
     /* remove tail slashes */
     for (start = args[0].len; --start > 0 && args[0].data[start] == '/';
         /* void */)
@@ -46,16 +50,465 @@ ncs_basename(int nargs, ngx_str_t *args)
 }
 
 
+/* Host facts, from sysconf(), /proc and sysfs, for a configuration to size
+ * itself to the machine. NGX_CONF_SCRIPT_<FACT> in the environment (e.g.
+ * NGX_CONF_SCRIPT_NCPU=4) overrides a fact, for tests or for facts this
+ * machine does not tell. They are not pure: the next load has to check
+ * them again. */
+
+#define NCS_HOST_READ_SIZE  4096
+
+
+off_t
+ncs_host_number(u_char **pos)
+{
+    off_t   n;
+    u_char *p;
+
+    for (p = *pos; *p == ' ' || *p == '\t'; ++p) { /* void */ }
+
+    if (*p < '0' || *p > '9') {
+        return -1;
+    }
+
+    for (n = 0; *p >= '0' && *p <= '9'; ++p) {
+        n = n * 10 + *p - '0';
+    }
+
+    *pos = p;
+    return n;
+}
+
+
+/* Reads a small host file (whose size stat() does not tell) into buf,
+ * NUL-terminated. */
+
+ssize_t
+ncs_host_read(const char *path, u_char *buf, size_t size)
+{
+    ssize_t   n;
+    ngx_fd_t  fd;
+
+    fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return -1;
+    }
+
+    n = ngx_read_fd(fd, buf, size - 1);
+    ngx_close_file(fd);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    buf[n] = '\0';
+    return n;
+}
+
+
+/* A /proc/meminfo field, in bytes. */
+
+off_t
+ncs_host_meminfo(const char *field)
+{
+    off_t   n;
+    size_t  len;
+    u_char *p, buf[NCS_HOST_READ_SIZE];
+
+    if (ncs_host_read("/proc/meminfo", buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+
+    len = ngx_strlen(field);
+
+    for (p = buf; *p; ++p) {
+        if (ngx_strncmp(p, field, len) == 0 && p[len] == ':') {
+            p += len + 1;
+            n = ncs_host_number(&p);
+            return n >= 0 && ngx_strncmp(p, " kB", 3) == 0 ? n * 1024 : n;
+        }
+        while (*p && *p != '\n') {
+            ++p;
+        }
+        if (*p == '\0') {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+off_t
+ncs_host_ncpu(void)
+{
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+
+off_t
+ncs_host_pagesize(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+
+off_t
+ncs_host_memtotal(void)
+{
+    off_t  n;
+
+    n = ncs_host_meminfo("MemTotal");
+
+#if defined(_SC_PHYS_PAGES)
+    if (n < 0 && sysconf(_SC_PHYS_PAGES) > 0) {
+        n = (off_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    }
+#endif
+
+    return n;
+}
+
+
+off_t
+ncs_host_hugepagesize(void)
+{
+    return ncs_host_meminfo("Hugepagesize");
+}
+
+
+/* Nodes listed as ranges, e.g. 0-1,3; a kernel without NUMA has none. */
+
+off_t
+ncs_host_nnuma(void)
+{
+    off_t   n, first, last;
+    u_char *p, buf[NCS_HOST_READ_SIZE];
+
+    if (ncs_host_read("/sys/devices/system/node/online", buf, sizeof(buf))
+        < 0)
+    {
+        return 1;
+    }
+
+    for (n = 0, p = buf; /* void */; ++p) {
+        first = last = ncs_host_number(&p);
+        if (first < 0) {
+            break;
+        }
+        if (*p == '-') {
+            ++p;
+            last = ncs_host_number(&p);
+            if (last < first) {
+                return -1;
+            }
+        }
+        n += last - first + 1;
+        if (*p != ',') {
+            break;
+        }
+    }
+
+    return n ? n : 1;
+}
+
+
+off_t
+ncs_host_l2_cache_size(void)
+{
+    off_t       n, level;
+    u_char     *p, buf[NCS_HOST_READ_SIZE];
+    ngx_uint_t  i;
+    char        path[sizeof("/sys/devices/system/cpu/cpu0/cache/index99/level")];
+
+    for (i = 0; i < 100; ++i) {
+        ngx_sprintf((u_char *) path,
+                    "/sys/devices/system/cpu/cpu0/cache/index%ui/level%Z", i);
+        if (ncs_host_read(path, buf, sizeof(buf)) < 0) {
+            break;
+        }
+        p = buf;
+        level = ncs_host_number(&p);
+        if (level != 2) {
+            continue;
+        }
+
+        ngx_sprintf((u_char *) path,
+                    "/sys/devices/system/cpu/cpu0/cache/index%ui/size%Z", i);
+        if (ncs_host_read(path, buf, sizeof(buf)) < 0) {
+            break;
+        }
+        p = buf;
+        n = ncs_host_number(&p);
+        switch (*p) {
+        case 'K': return n * 1024;
+        case 'M': return n * 1024 * 1024;
+        default: return n;
+        }
+    }
+
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    if (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0) {
+        return sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+
+    return -1;
+}
+
+
+/* The fact name (as in the environment), overridden or read with get. */
+
+off_t
+ncs_host_fact(ngx_conf_t *cf, const char *name, off_t (*get)(void))
+{
+    off_t   n;
+    u_char *p, var[64];
+
+    ngx_sprintf(var, "NGX_CONF_SCRIPT_%s%Z", name);
+
+    p = (u_char *) getenv((char *) var);
+    if (p) {
+        n = ncs_host_number(&p);
+        if (n < 0 || *p) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number in %s: \"%s\"", var,
+                               getenv((char *) var));
+            return -1;
+        }
+        return n;
+    }
+
+    n = get();
+    if (n < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "this host does not tell its %s, set %s", name,
+                           var);
+    }
+
+    return n;
+}
+
+
+ngx_str_t
+ncs_host_value(ngx_conf_t *cf, const char *name, off_t (*get)(void))
+{
+    off_t      n;
+    ngx_str_t  val;
+
+    ngx_str_null(&val);
+
+    n = ncs_host_fact(cf, name, get);
+    if (n < 0) {
+        return val;
+    }
+
+    val.data = ngx_pnalloc(cf->temp_pool, NGX_OFF_T_LEN);
+    if (val.data) {
+        val.len = ngx_sprintf(val.data, "%O", n) - val.data;
+    }
+
+    return val;
+}
+
+
+ngx_str_t
+ncs_ncpu(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "NCPU", ncs_host_ncpu);
+}
+
+
+ngx_str_t
+ncs_nnuma(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "NNUMA", ncs_host_nnuma);
+}
+
+
+ngx_str_t
+ncs_memtotal(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "MEMTOTAL", ncs_host_memtotal);
+}
+
+
+ngx_str_t
+ncs_pagesize(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "PAGESIZE", ncs_host_pagesize);
+}
+
+
+ngx_str_t
+ncs_hugepagesize(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "HUGEPAGESIZE", ncs_host_hugepagesize);
+}
+
+
+ngx_str_t
+ncs_l2_cache_size(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_host_value(cf, "L2_CACHE_SIZE", ncs_host_l2_cache_size);
+}
+
+
+/* cpumask([[first,] count]): a worker_cpu_affinity mask of count CPUs from
+ * first (all of them by default), CPU 0 rightmost. */
+
+ngx_str_t
+ncs_cpumask(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    off_t      ncpu;
+    ngx_int_t  first, count, i;
+    ngx_str_t  mask;
+
+    ngx_str_null(&mask);
+
+    ncpu = ncs_host_fact(cf, "NCPU", ncs_host_ncpu);
+    if (ncpu < 0) {
+        return mask;
+    }
+
+    first = 0;
+    count = ncpu;
+
+    if (nargs > 0) {
+        count = ngx_atoi(args[nargs - 1].data, args[nargs - 1].len);
+    }
+    if (nargs > 1) {
+        first = ngx_atoi(args[0].data, args[0].len);
+    }
+
+    if (first == NGX_ERROR || count == NGX_ERROR || count == 0
+        || first + count > ncpu)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "cpumask() needs a first CPU and a positive count "
+                           "within the %O CPUs", ncpu);
+        return mask;
+    }
+
+    mask.len = first + count;
+    mask.data = ngx_pnalloc(cf->temp_pool, mask.len);
+    if (mask.data == NULL) {
+        return mask;
+    }
+
+    for (i = 0; i < first + count; ++i) {
+        mask.data[mask.len - 1 - i] = i < first ? '0' : '1';
+    }
+
+    return mask;
+}
+
+
+/* min(a, b, ...) and max(a, b, ...), between numbers of the same kind of
+ * unit, as arithmetic's: min(4k, 1m) is 4k. */
+
+ngx_str_t
+ncs_minmax(ngx_conf_t *cf, int nargs, ngx_str_t *args, ngx_int_t sign)
+{
+    int                    i;
+    ngx_str_t              val;
+    ngx_conf_script_num_t  best, num;
+
+    ngx_str_null(&val);
+
+    for (i = 0; i < nargs; ++i) {
+        if (ngx_conf_script_num(&args[i], &num) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" is not a number", &args[i]);
+            return val;
+        }
+
+        if (i == 0) {
+            best = num;
+            continue;
+        }
+
+        if (ngx_conf_script_num_unify(&best, &num) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "cannot compare \"%V\" with \"%V\"",
+                               &args[0], &args[i]);
+            return val;
+        }
+
+        if (sign > 0 ? num.value > best.value : num.value < best.value) {
+            best = num;
+        }
+    }
+
+    val.data = ngx_pnalloc(cf->temp_pool, NGX_CONF_SCRIPT_NUM_LEN);
+    if (val.data) {
+        val.len = ngx_conf_script_num_format(val.data, &best) - val.data;
+    }
+
+    return val;
+}
+
+
+ngx_str_t
+ncs_min(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_minmax(cf, nargs, args, -1);
+}
+
+
+ngx_str_t
+ncs_max(ngx_conf_t *cf, int nargs, ngx_str_t *args)
+{
+    return ncs_minmax(cf, nargs, args, 1);
+}
+
+
 static ngx_conf_script_func_t functions[] = {
 
     { ngx_string("dirname"),
-      NGX_CONF_TAKE1,
+      NGX_CONF_TAKE1|NGX_CONF_SCRIPT_PURE,
       ncs_dirname },
 
     { ngx_string("basename"),
-      NGX_CONF_TAKE1|NGX_CONF_TAKE2,
+      NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_SCRIPT_PURE,
       ncs_basename },
 
+    { ngx_string("ncpu"),
+      NGX_CONF_NOARGS,
+      ncs_ncpu },
+
+    { ngx_string("nnuma"),
+      NGX_CONF_NOARGS,
+      ncs_nnuma },
+
+    { ngx_string("memtotal"),
+      NGX_CONF_NOARGS,
+      ncs_memtotal },
+
+    { ngx_string("pagesize"),
+      NGX_CONF_NOARGS,
+      ncs_pagesize },
+
+    { ngx_string("hugepagesize"),
+      NGX_CONF_NOARGS,
+      ncs_hugepagesize },
+
+    { ngx_string("l2_cache_size"),
+      NGX_CONF_NOARGS,
+      ncs_l2_cache_size },
+
+    { ngx_string("cpumask"),
+      NGX_CONF_NOARGS|NGX_CONF_TAKE1|NGX_CONF_TAKE2,
+      ncs_cpumask },
+
+    { ngx_string("min"),
+      NGX_CONF_1MORE|NGX_CONF_SCRIPT_PURE,
+      ncs_min },
+
+    { ngx_string("max"),
+      NGX_CONF_1MORE|NGX_CONF_SCRIPT_PURE,
+      ncs_max },
+
     { ngx_string(""),
       0,
       NULL }
@@ -8,12 +8,40 @@
 #include <ngx_module.h>
 
 
+/* values a foreach may repeat its block for, ranges included */
+#define NGX_CSCRIPT_FOREACH_MAX  4096
+
+
 char *ngx_conf_scripts(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *ngx_conf_script_start(ngx_conf_t *cf, ngx_str_t *open_delim,
     ngx_str_t *close_delim);
 char *ngx_conf_script_end(ngx_conf_t *cf);
 char *ngx_cscript_static(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_cscript_define(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_conf_script_vars_t *ngx_cscript_vars(ngx_conf_t *cf);
+char *ngx_cscript_foreach(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_cscript_foreach_range(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_array_t *values);
+ngx_int_t ngx_cscript_foreach_bound(u_char *p, u_char *last);
+char *ngx_cscript_static_if(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_cscript_static_else(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_cscript_branch(ngx_conf_t *cf, ngx_uint_t taken);
+ngx_int_t ngx_conf_scripts_flag(ngx_conf_t *cf, ngx_command_t *cmd);
+char *ngx_conf_scripts_stats(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_conf_scripts_prefetch(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_conf_scripts_reuse(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_conf_scripts_snapshot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_conf_scripts_fold_set(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_command_t  ngx_conf_script_commands[] = {
@@ -32,6 +60,69 @@ static ngx_command_t  ngx_conf_script_commands[] = {
       0,
       NULL },
 
+    { ngx_string("define"),
+      NGX_ANY_CONF|NGX_CONF_TAKE2,
+      ngx_cscript_define,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("foreach"),
+      NGX_ANY_CONF|NGX_CONF_BLOCK|NGX_CONF_2MORE,
+      ngx_cscript_foreach,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("static_if"),
+      NGX_ANY_CONF|NGX_CONF_BLOCK|NGX_CONF_1MORE,
+      ngx_cscript_static_if,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("static_else"),
+      NGX_ANY_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
+      ngx_cscript_static_else,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("conf_scripts_stats"),
+      NGX_ANY_CONF|NGX_CONF_FLAG,
+      ngx_conf_scripts_stats,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("conf_scripts_prefetch"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_scripts_prefetch,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("conf_scripts_reuse"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_scripts_reuse,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("conf_scripts_snapshot"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_scripts_snapshot,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("conf_scripts_fold_set"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_scripts_fold_set,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -87,7 +178,6 @@ ngx_conf_scripts(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 char *
 ngx_conf_script_start(ngx_conf_t *cf, ngx_str_t *open_delim, ngx_str_t *close_delim)
 {
-    char                     *rv;
     ngx_conf_script_delim_t  *delim;
 
     if (!cf->conf_file->script_delim
@@ -123,39 +213,488 @@ ngx_conf_script_end(ngx_conf_t *cf)
 }
 
 
+/* Returns the current block's variables, creating them if needed. */
+
+ngx_conf_script_vars_t *
+ngx_cscript_vars(ngx_conf_t *cf)
+{
+    if (!cf->vars || cf->vars->block_level < cf->cycle->conf_block_level) {
+        return ngx_conf_script_vars_push(cf);
+    }
+
+    return cf->vars;
+}
+
+
 char *
 ngx_cscript_static(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char                   *rv;
     ngx_str_t              *args;
-    ngx_conf_script_vars_t *vars;
 
-    if (!cf->vars || cf->vars->block_level < cf->cycle->conf_block_level) {
-        vars = ngx_palloc(cf->temp_pool, sizeof(ngx_conf_script_vars_t));
-        if (!vars) {
+    if (ngx_cscript_vars(cf) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    args = cf->args->elts;
+
+    if (ngx_conf_complex_value_shared(cf, &args[2]) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_script_var_set(cf, cf->vars, &args[1], &args[2])
+        != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "could not set var %s", args[1].data);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_cscript_define(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                name, *args;
+    ngx_conf_script_delim_t *delim;
+
+    args = cf->args->elts;
+    delim = cf->conf_file->script_delim;
+
+    /* The name comes between marks, as it will be referenced; it is then
+     * bound without them, so that it survives a change of marks. */
+    name = args[1];
+    if (!delim
+        || name.len < delim->open.len + delim->close.len
+        || ngx_strncmp(name.data, delim->open.data, delim->open.len) != 0
+        || ngx_strncmp(name.data + name.len - delim->close.len,
+                       delim->close.data, delim->close.len) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "define expects its name between the conf_scripts "
+                           "marks, got \"%V\"", &args[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data += delim->open.len;
+    name.len -= delim->open.len + delim->close.len;
+    while (name.len && name.data[name.len - 1] == ' ') {
+        --name.len;
+    }
+    while (name.len && name.data[0] == ' ') {
+        ++name.data;
+        --name.len;
+    }
+
+    if (!name.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name in \"%V\"", &args[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_cscript_vars(cf) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_script_var_define(cf, cf->vars, &name, &args[2])
+        != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "could not define var %V", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/* foreach name value... { body }: parses body once per value, name being
+ * set to the value in a block level of its own, as if the body had been
+ * written that many times. A value first..last is the integers from
+ * first to last, up to NGX_CSCRIPT_FOREACH_MAX values in all. */
+
+char *
+ngx_cscript_foreach(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char                    *rv;
+    ngx_str_t               *args, *value, name;
+    ngx_uint_t               i, line;
+    ngx_array_t              values;
+    ngx_conf_script_vars_t  *vars;
+    ngx_conf_script_loop_t  *loop;
+
+    args = cf->args->elts;
+    name = args[1];
+
+    if (ngx_array_init(&values, cf->temp_pool, cf->args->nelts,
+                       sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; ++i) {
+        if (ngx_conf_complex_value_shared(cf, &args[i]) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        switch (ngx_cscript_foreach_range(cf, &args[i], &values)) {
+
+        case NGX_OK:
+            continue;
+
+        case NGX_DECLINED:
+            break;
+
+        default:
+            return NGX_CONF_ERROR;
+        }
+
+        value = ngx_array_push(&values);
+        if (value == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *value = args[i];
+    }
+
+    /* reading the body reuses cf->args */
+    if (ngx_conf_script_loop_read(cf, &loop) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* The closing brace has been read with the body: each pass opens a
+     * block level of its own, which the replayed brace closes. */
+    ngx_conf_script_block_done(cf);
+
+    line = cf->conf_file->line;
+    value = values.elts;
+
+    for (i = 0; i < values.nelts; ++i) {
+        ngx_conf_script_block_start(cf);
+
+        vars = ngx_conf_script_vars_push(cf);
+        if (vars == NULL
+            || ngx_conf_script_var_set(cf, vars, &name, &value[i])
+               != NGX_OK)
+        {
+            ngx_conf_script_block_done(cf);
             return NGX_CONF_ERROR;
         }
-        /* By putting our temp string in a temp pool, better use the
-         * result as soon as read or copy it to a more protected store. */
-        if(ngx_array_init(&vars->vars, cf->temp_pool, 4, sizeof(ngx_conf_script_var_t)) != NGX_OK) {
-            ngx_free(vars);
+
+        ngx_conf_script_loop_enter(cf, loop);
+        rv = ngx_conf_parse(cf, NULL);
+        ngx_conf_script_loop_leave(cf, loop);
+
+        if (rv != NGX_CONF_OK) {
+            return rv;
+        }
+    }
+
+    cf->conf_file->line = line;
+
+    return NGX_CONF_OK;
+}
+
+
+/* Appends the numbers of a first..last value, NGX_DECLINED if it is not
+ * one: a value that starts as a number and has .. must be a valid range. */
+
+ngx_int_t
+ngx_cscript_foreach_range(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_array_t *values)
+{
+    u_char      *dots, *last_char;
+    ngx_int_t    first, last, n, step;
+    ngx_str_t   *number;
+    ngx_uint_t   count;
+
+    last_char = value->data + value->len;
+
+    if (value->len == 0
+        || (value->data[0] != '-'
+            && (value->data[0] < '0' || value->data[0] > '9')))
+    {
+        return NGX_DECLINED;
+    }
+
+    for (dots = value->data; dots + 1 < last_char; ++dots) {
+        if (dots[0] == '.' && dots[1] == '.') {
+            break;
+        }
+    }
+
+    if (dots + 1 >= last_char) {
+        return NGX_DECLINED;
+    }
+
+    first = ngx_cscript_foreach_bound(value->data, dots);
+    last = ngx_cscript_foreach_bound(dots + 2, last_char);
+
+    if (first == NGX_ERROR || last == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid range \"%V\", it must be "
+                           "first..last with integer bounds", value);
+        return NGX_ERROR;
+    }
+
+    count = (first <= last ? (ngx_uint_t) last - (ngx_uint_t) first
+                           : (ngx_uint_t) first - (ngx_uint_t) last);
+
+    if (count >= NGX_CSCRIPT_FOREACH_MAX
+        || values->nelts + count >= NGX_CSCRIPT_FOREACH_MAX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many values in range \"%V\", a foreach "
+                           "takes at most %d", value,
+                           NGX_CSCRIPT_FOREACH_MAX);
+        return NGX_ERROR;
+    }
+
+    step = first <= last ? 1 : -1;
+
+    for (n = first; /* void */; n += step) {
+        number = ngx_array_push(values);
+        if (number == NULL) {
+            return NGX_ERROR;
+        }
+
+        number->data = ngx_pnalloc(cf->temp_pool, NGX_INT_T_LEN);
+        if (number->data == NULL) {
+            return NGX_ERROR;
+        }
+        number->len = ngx_sprintf(number->data, "%i", n) - number->data;
+
+        if (n == last) {
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* An optionally negative integer, or NGX_ERROR. */
+
+ngx_int_t
+ngx_cscript_foreach_bound(u_char *p, u_char *last)
+{
+    ngx_int_t  n;
+
+    if (p < last && *p == '-') {
+        n = ngx_atoi(p + 1, last - p - 1);
+        return n == NGX_ERROR ? NGX_ERROR : -n;
+    }
+
+    return ngx_atoi(p, last - p);
+}
+
+
+/* static_if condition... { body }: the body is parsed if the condition
+ * (its arguments joined by spaces, then expanded) is neither empty nor 0,
+ * else skipped unread, as is a static_else { body } right after it
+ * otherwise. */
+
+char *
+ngx_cscript_static_if(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char        *rv;
+    u_char      *p;
+    ngx_str_t   *args, cond;
+    ngx_uint_t   i, taken;
+
+    args = cf->args->elts;
+    cond = args[1];
+
+    if (cf->args->nelts > 2) {
+        for (i = 1, cond.len = 0; i < cf->args->nelts; ++i) {
+            cond.len += args[i].len + 1;
+        }
+
+        cond.data = ngx_pnalloc(cf->temp_pool, cond.len);
+        if (cond.data == NULL) {
             return NGX_CONF_ERROR;
         }
-        vars->block_level = cf->cycle->conf_block_level;
-        vars->next = cf->vars;
-        cf->vars = vars;
+
+        for (i = 1, p = cond.data; i < cf->args->nelts; ++i) {
+            p = ngx_cpymem(p, args[i].data, args[i].len);
+            *p++ = ' ';
+        }
+        --cond.len;
+    }
+
+    if (ngx_conf_complex_value_shared(cf, &cond) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    taken = ngx_conf_script_true(&cond);
+
+    rv = ngx_cscript_branch(cf, taken);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    ngx_conf_script_branch(cf, taken);
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_cscript_static_else(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    switch (ngx_conf_script_branch_else(cf)) {
+
+    case NGX_OK:
+        return ngx_cscript_branch(cf, 1);
+
+    case NGX_DECLINED:
+        return ngx_cscript_branch(cf, 0);
+
+    default:
+        return NGX_CONF_ERROR;
+    }
+}
+
+
+char *
+ngx_cscript_branch(ngx_conf_t *cf, ngx_uint_t taken)
+{
+    if (taken) {
+        return ngx_conf_parse(cf, NULL);
+    }
+
+    if (ngx_conf_script_block_skip(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
+    return NGX_CONF_OK;
+}
+
+
+/* The argument of a NGX_CONF_FLAG directive: 1, 0, or NGX_ERROR once
+ * reported. */
+
+ngx_int_t
+ngx_conf_scripts_flag(ngx_conf_t *cf, ngx_command_t *cmd)
+{
+    ngx_str_t  *args;
+
     args = cf->args->elts;
 
-    if (ngx_conf_complex_value(cf, &args[2]) != NGX_OK) {
+    if (ngx_strcasecmp(args[1].data, (u_char *) "on") == 0) {
+        return 1;
+    }
+
+    if (ngx_strcasecmp(args[1].data, (u_char *) "off") == 0) {
+        return 0;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%s\" in \"%V\" directive, "
+                       "it must be \"on\" or \"off\"",
+                       args[1].data, &cmd->name);
+
+    return NGX_ERROR;
+}
+
+
+char *
+ngx_conf_scripts_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t  on;
+
+    on = ngx_conf_scripts_flag(cf, cmd);
+
+    if (on == NGX_ERROR || ngx_conf_script_stats(cf, on) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    if (ngx_conf_script_var_set(cf->vars, &args[1], &args[2])
-        != NGX_OK) {
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_conf_scripts_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t   *args;
+    ngx_int_t    threads;
+
+    args = cf->args->elts;
+
+    if (ngx_strcmp(args[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    threads = ngx_atoi(args[1].data, args[1].len);
+    if (threads <= 0 || threads > 64) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-            "could not set var %s", args[1].data);
+                           "invalid value \"%V\" in \"%V\" directive, "
+                           "it must be \"off\" or a number of threads "
+                           "from 1 to 64", &args[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    switch (ngx_conf_script_prefetch(cf, threads)) {
+
+    case NGX_OK:
+        return NGX_CONF_OK;
+
+    case NGX_DECLINED:
+        return "is duplicate";
+
+    default:
+        return NGX_CONF_ERROR;
+    }
+}
+
+
+char *
+ngx_conf_scripts_reuse(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t  on;
+
+    on = ngx_conf_scripts_flag(cf, cmd);
+
+    if (on == NGX_ERROR || ngx_conf_script_reuse(cf, on) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_conf_scripts_snapshot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t   *args;
+
+    args = cf->args->elts;
+
+    switch (ngx_conf_script_snapshot(cf, &args[1])) {
+
+    case NGX_OK:
+        return NGX_CONF_OK;
+
+    case NGX_DECLINED:
+        return "is duplicate";
+
+    case NGX_BUSY:
+        return "must come first in the main configuration file, "
+               "before any include or script";
+
+    default:
+        return NGX_CONF_ERROR;
+    }
+}
+
+
+char *
+ngx_conf_scripts_fold_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t  on;
+
+    on = ngx_conf_scripts_flag(cf, cmd);
+
+    if (on == NGX_ERROR || ngx_conf_script_fold(cf, on) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
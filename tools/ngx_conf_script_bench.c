@@ -0,0 +1,409 @@
+
+/*
+ * Copyright (C) Guillaume Outters
+ */
+
+
+/*
+ * Micro-benchmarks of the config-script evaluator, built against the stubs
+ * in stub/ instead of a full nginx:
+ *
+ *     make -C tools bench && tools/ngx_conf_script_bench [-n runs] [workload...]
+ *
+ * A workload is a name followed by its parameters, e.g. "scan:4096:8" for a
+ * 4 KB string with 8 expressions; without any, the whole matrix is run.
+ * Each line reports the nanoseconds and the bytes allocated (in cf->pool and
+ * the temp pool) per ngx_conf_complex_value() call.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <time.h>
+
+
+typedef struct {
+    ngx_conf_t        cf;
+    ngx_cycle_t       cycle;
+    ngx_conf_file_t   file;
+    ngx_log_t         log;
+    ngx_conf_script_delim_t  delim;
+} ngx_bench_env_t;
+
+typedef struct {
+    const char       *name;
+    const char       *params;
+    ngx_int_t       (*setup)(ngx_bench_env_t *env, ngx_int_t a, ngx_int_t b,
+                             ngx_str_t *expr);
+    ngx_int_t         a;
+    ngx_int_t         b;
+} ngx_bench_t;
+
+
+static ngx_int_t ngx_bench_scan(ngx_bench_env_t *env, ngx_int_t len,
+    ngx_int_t nexprs, ngx_str_t *expr);
+static ngx_int_t ngx_bench_vars(ngx_bench_env_t *env, ngx_int_t nvars,
+    ngx_int_t nrefs, ngx_str_t *expr);
+static ngx_int_t ngx_bench_depth(ngx_bench_env_t *env, ngx_int_t depth,
+    ngx_int_t nvars, ngx_str_t *expr);
+static ngx_int_t ngx_bench_funcs(ngx_bench_env_t *env, ngx_int_t nesting,
+    ngx_int_t unused, ngx_str_t *expr);
+
+
+static ngx_bench_t  ngx_bench_matrix[] = {
+    { "scan", "len:exprs", ngx_bench_scan, 64, 0 },
+    { "scan", "len:exprs", ngx_bench_scan, 4096, 0 },
+    { "scan", "len:exprs", ngx_bench_scan, 64, 1 },
+    { "scan", "len:exprs", ngx_bench_scan, 4096, 8 },
+    { "scan", "len:exprs", ngx_bench_scan, 4096, 64 },
+    { "vars", "vars:refs", ngx_bench_vars, 10, 1 },
+    { "vars", "vars:refs", ngx_bench_vars, 1000, 1 },
+    { "vars", "vars:refs", ngx_bench_vars, 10000, 1 },
+    { "vars", "vars:refs", ngx_bench_vars, 10000, 16 },
+    { "depth", "depth:vars", ngx_bench_depth, 1, 100 },
+    { "depth", "depth:vars", ngx_bench_depth, 8, 100 },
+    { "depth", "depth:vars", ngx_bench_depth, 32, 100 },
+    { "funcs", "nesting", ngx_bench_funcs, 1, 0 },
+    { "funcs", "nesting", ngx_bench_funcs, 4, 0 },
+    { "funcs", "nesting", ngx_bench_funcs, 16, 0 },
+    { NULL, NULL, NULL, 0, 0 }
+};
+
+
+static ngx_int_t
+ngx_bench_init(ngx_bench_env_t *env)
+{
+    static ngx_str_t  path = ngx_string("/var/www/apps/myapp/conf/nginx.conf");
+
+    ngx_memzero(env, sizeof(ngx_bench_env_t));
+
+    env->log.log_level = NGX_LOG_WARN;
+
+    env->cycle.log = &env->log;
+    env->cycle.pool = ngx_create_pool(16384, &env->log);
+    if (env->cycle.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    env->cf.cycle = &env->cycle;
+    env->cf.log = &env->log;
+    env->cf.pool = env->cycle.pool;
+    env->cf.temp_pool = ngx_create_pool(16384, &env->log);
+    if (env->cf.temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    env->cf.args = ngx_array_create(env->cf.pool, 4, sizeof(ngx_str_t));
+    if (env->cf.args == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&env->delim.open, "<");
+    ngx_str_set(&env->delim.close, ">");
+    env->delim.owner = &env->file;
+
+    env->file.file.name = path;
+    env->file.file.fd = NGX_INVALID_FILE;
+    env->file.line = 1;
+    env->file.script_delim = &env->delim;
+    env->cf.conf_file = &env->file;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_done(ngx_bench_env_t *env)
+{
+    ngx_destroy_pool(env->cf.temp_pool);
+    ngx_destroy_pool(env->cycle.pool);
+}
+
+
+static ngx_int_t
+ngx_bench_static(ngx_bench_env_t *env, ngx_str_t *name, ngx_str_t *val)
+{
+    if ((env->cf.vars == NULL
+         || env->cf.vars->block_level < env->cycle.conf_block_level)
+        && ngx_conf_script_vars_push(&env->cf) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_conf_script_var_set(&env->cf, env->cf.vars, name, val);
+}
+
+
+static ngx_int_t
+ngx_bench_name(ngx_bench_env_t *env, ngx_str_t *name, const char *fmt,
+    ngx_int_t n)
+{
+    u_char  buf[64];
+
+    name->len = ngx_sprintf(buf, fmt, n) - buf;
+    name->data = buf;
+
+    name->data = ngx_pstrdup(env->cf.temp_pool, name);
+    if (name->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* A len bytes path-like string, with nexprs <.> spread over it. */
+
+static ngx_int_t
+ngx_bench_scan(ngx_bench_env_t *env, ngx_int_t len, ngx_int_t nexprs,
+    ngx_str_t *expr)
+{
+    ngx_int_t   i, step;
+
+    expr->data = ngx_pnalloc(env->cf.temp_pool, len + 1);
+    if (expr->data == NULL) {
+        return NGX_ERROR;
+    }
+    expr->len = len;
+
+    for (i = 0; i < len; ++i) {
+        expr->data[i] = "abcdefgh/ij.kl-m"[i % 16];
+    }
+
+    step = nexprs ? len / nexprs : 0;
+    for (i = 0; i < nexprs && i * step + 3 <= len; ++i) {
+        ngx_memcpy(&expr->data[i * step], "<.>", 3);
+    }
+
+    return NGX_OK;
+}
+
+
+/* nrefs references to variables picked among nvars defined ones. */
+
+static ngx_int_t
+ngx_bench_vars(ngx_bench_env_t *env, ngx_int_t nvars, ngx_int_t nrefs,
+    ngx_str_t *expr)
+{
+    u_char     *p;
+    ngx_int_t   i;
+    ngx_str_t   name, val;
+
+    for (i = 0; i < nvars; ++i) {
+        if (ngx_bench_name(env, &name, "var%i", i) != NGX_OK
+            || ngx_bench_name(env, &val, "value-%i", i) != NGX_OK
+            || ngx_bench_static(env, &name, &val) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    p = expr->data = ngx_pnalloc(env->cf.temp_pool, nrefs * 24 + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < nrefs; ++i) {
+        p = ngx_sprintf(p, "<var%i>/", (i * 7919) % nvars);
+    }
+    expr->len = p - expr->data;
+
+    return NGX_OK;
+}
+
+
+/* A variable defined at the outermost of depth nested blocks, each of which
+ * defines nvars others. */
+
+static ngx_int_t
+ngx_bench_depth(ngx_bench_env_t *env, ngx_int_t depth, ngx_int_t nvars,
+    ngx_str_t *expr)
+{
+    ngx_int_t   i, level;
+    ngx_str_t   name, val;
+
+    ngx_str_set(&name, "outer");
+    ngx_str_set(&val, "outer-value");
+
+    if (ngx_bench_static(env, &name, &val) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (level = 0; level < depth; ++level) {
+        ngx_conf_script_block_start(&env->cf);
+
+        for (i = 0; i < nvars; ++i) {
+            if (ngx_bench_name(env, &name, "level%i", level * nvars + i)
+                != NGX_OK
+                || ngx_bench_static(env, &name, &val) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    ngx_str_set(expr, "<outer>");
+
+    return NGX_OK;
+}
+
+
+/* basename(dirname(...(.)...)) */
+
+static ngx_int_t
+ngx_bench_funcs(ngx_bench_env_t *env, ngx_int_t nesting, ngx_int_t unused,
+    ngx_str_t *expr)
+{
+    u_char     *p;
+    ngx_int_t   i;
+
+    p = expr->data = ngx_pnalloc(env->cf.temp_pool, nesting * 10 + 8);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(p, "<", 1);
+    for (i = 0; i < nesting; ++i) {
+        p = ngx_cpymem(p, i ? "dirname(" : "basename(", i ? 8 : 9);
+    }
+    p = ngx_cpymem(p, ".", 1);
+    for (i = 0; i < nesting; ++i) {
+        *p++ = ')';
+    }
+    p = ngx_cpymem(p, ">", 1);
+    expr->len = p - expr->data;
+
+    return NGX_OK;
+}
+
+
+static uint64_t
+ngx_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static ngx_int_t
+ngx_bench_run(ngx_bench_t *bench, ngx_int_t runs)
+{
+    size_t            allocated;
+    uint64_t          start, elapsed;
+    ngx_int_t         i;
+    ngx_str_t         expr, value;
+    ngx_bench_env_t   env;
+
+    if (ngx_bench_init(&env) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (bench->setup(&env, bench->a, bench->b, &expr) != NGX_OK) {
+        ngx_bench_done(&env);
+        return NGX_ERROR;
+    }
+
+    /* warm up, and check the expression evaluates */
+    value = expr;
+    if (ngx_conf_complex_value_shared(&env.cf, &value) != NGX_OK) {
+        ngx_bench_done(&env);
+        return NGX_ERROR;
+    }
+
+    allocated = env.cf.pool->allocated + env.cf.temp_pool->allocated;
+    start = ngx_bench_now();
+
+    for (i = 0; i < runs; ++i) {
+        value = expr;
+        if (ngx_conf_complex_value_shared(&env.cf, &value) != NGX_OK) {
+            ngx_bench_done(&env);
+            return NGX_ERROR;
+        }
+    }
+
+    elapsed = ngx_bench_now() - start;
+    allocated = env.cf.pool->allocated + env.cf.temp_pool->allocated
+                - allocated;
+
+    printf("%-6s %-10s %6d:%-6d %12.1f ns/op %10.1f B/op\n",
+           bench->name, bench->params, (int) bench->a, (int) bench->b,
+           (double) elapsed / runs, (double) allocated / runs);
+
+    ngx_bench_done(&env);
+
+    return NGX_OK;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int           i, failed;
+    char         *p;
+    ngx_int_t     runs;
+    ngx_bench_t  *b, bench;
+
+    runs = 100000;
+    failed = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+            continue;
+        }
+
+        fprintf(stderr, "usage: %s [-n runs] [workload[:a[:b]]...]\n"
+                        "workloads: scan:len:exprs vars:vars:refs "
+                        "depth:depth:vars funcs:nesting\n", argv[0]);
+        return 2;
+    }
+
+    if (runs <= 0) {
+        runs = 1;
+    }
+
+    if (i == argc) {
+        for (b = ngx_bench_matrix; b->name; ++b) {
+            if (ngx_bench_run(b, runs) != NGX_OK) {
+                fprintf(stderr, "%s %d:%d failed\n",
+                        b->name, (int) b->a, (int) b->b);
+                failed = 1;
+            }
+        }
+
+        return failed;
+    }
+
+    for ( /* void */ ; i < argc; ++i) {
+        p = strchr(argv[i], ':');
+        if (p) {
+            *p++ = '\0';
+        }
+
+        for (b = ngx_bench_matrix; b->name; ++b) {
+            if (strcmp(b->name, argv[i]) == 0) {
+                break;
+            }
+        }
+
+        if (b->name == NULL) {
+            fprintf(stderr, "unknown workload \"%s\"\n", argv[i]);
+            return 2;
+        }
+
+        bench = *b;
+        bench.a = p ? atoi(p) : b->a;
+        p = p ? strchr(p, ':') : NULL;
+        bench.b = p ? atoi(p + 1) : b->b;
+
+        if (ngx_bench_run(&bench, runs) != NGX_OK) {
+            fprintf(stderr, "%s failed\n", argv[i]);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,1207 @@
+/*
+ * Copyright (C) Guillaume Outters
+ */
+
+
+/*
+ * Offline expansion of config scripts, built from the module's sources
+ * against the stubs in stub/ instead of a full nginx:
+ *
+ *     make -C tools expand
+ *     tools/ngx_conf_script_expand [-j threads] [-o dir] [-p prefix] [-v] \
+ *         path...
+ *
+ * Each path is a top-level configuration file, or a directory searched for
+ * *.conf files; paths and the prefix are made absolute first, as nginx
+ * names its files. Each top-level file is parsed as nginx would: includes are
+ * followed (relative to the prefix, by default the directory of the
+ * top-level file), conf_scripts, static, define and the other module
+ * directives go to the module's own handlers, blocks scope variables and
+ * included files inherit the marks. Every top-level file gets its own
+ * context, and as many are parsed at once as there are threads (one per
+ * core by default).
+ *
+ * Directives are printed with their arguments expanded and includes
+ * inlined, to stdout in the order of the paths, or with -o to a file of the
+ * same relative path under dir. The exit status tells if all of them
+ * expanded without error.
+ *
+ * Unlike nginx, which only expands the arguments of the directives patched
+ * for it, every argument is expanded here.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_module.h>
+#include <dirent.h>
+#include <pthread.h>
+
+
+#define NGX_EXPAND_POOL_SIZE  16384
+
+#define LF     (u_char) '\n'
+#define CR     (u_char) '\r'
+
+
+typedef struct {
+    char               *path;        /* top-level file */
+    char               *out;         /* file to write to, or NULL */
+    char               *text;        /* else what gets printed */
+    size_t              len;
+    ngx_int_t           rc;
+} ngx_expand_job_t;
+
+typedef struct {
+    pthread_mutex_t     mtx;
+    ngx_expand_job_t   *jobs;
+    ngx_uint_t          njobs;
+    ngx_uint_t          next;
+    ngx_str_t           prefix;
+    ngx_uint_t          log_level;
+} ngx_expand_queue_t;
+
+typedef struct {
+    ngx_conf_t          cf;
+    ngx_cycle_t         cycle;
+    ngx_log_t           log;
+    FILE               *out;
+    ngx_uint_t          depth;       /* of blocks, for indentation */
+    ngx_str_t           prefix;
+} ngx_expand_env_t;
+
+
+static ngx_int_t ngx_expand_job(ngx_expand_queue_t *queue,
+    ngx_expand_job_t *job);
+static ngx_int_t ngx_expand_parse(ngx_expand_env_t *env,
+    ngx_str_t *filename);
+static ngx_int_t ngx_expand_handler(ngx_expand_env_t *env, ngx_int_t last);
+static ngx_int_t ngx_expand_command(ngx_expand_env_t *env,
+    ngx_command_t *cmd, ngx_int_t last);
+static ngx_int_t ngx_expand_include(ngx_expand_env_t *env);
+static ngx_int_t ngx_expand_read_token(ngx_conf_t *cf);
+static ngx_int_t ngx_expand_load(ngx_conf_t *cf);
+static void ngx_expand_print(ngx_expand_env_t *env, ngx_int_t last);
+static void ngx_expand_indent(ngx_expand_env_t *env);
+static void *ngx_expand_thread(void *data);
+static ngx_int_t ngx_expand_add(ngx_array_t *jobs, char *path, char *root,
+    char *outdir);
+static ngx_int_t ngx_expand_add_dir(ngx_array_t *jobs, char *dir,
+    char *root, char *outdir);
+static ngx_int_t ngx_expand_mkdirs(char *path);
+static char *ngx_expand_full_name(ngx_pool_t *pool, char *path,
+    ngx_uint_t dir);
+static int ngx_expand_cmp_jobs(const void *one, const void *two);
+
+
+extern ngx_module_t  ngx_conf_script_module;
+
+static const ngx_uint_t  argument_number[] = {
+    NGX_CONF_NOARGS,
+    NGX_CONF_TAKE1,
+    NGX_CONF_TAKE2,
+    NGX_CONF_TAKE3,
+    NGX_CONF_TAKE4,
+    NGX_CONF_TAKE5,
+    NGX_CONF_TAKE6,
+    NGX_CONF_TAKE7
+};
+
+
+int
+main(int argc, char **argv)
+{
+    int                  c, rc;
+    long                 n;
+    char                *outdir, *prefix, *path;
+    pthread_t           *tids;
+    ngx_log_t            log;
+    ngx_uint_t           i, nthreads;
+    ngx_pool_t          *pool;
+    struct stat          sb;
+    ngx_array_t          jobs;
+    ngx_expand_job_t    *job;
+    ngx_expand_queue_t   queue;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = n > 0 ? n : 1;
+    outdir = NULL;
+    prefix = NULL;
+    log.log_level = NGX_LOG_WARN;
+
+    while ((c = getopt(argc, argv, "j:o:p:v")) != -1) {
+        switch (c) {
+
+        case 'j':
+            n = atol(optarg);
+            if (n <= 0) {
+                fprintf(stderr, "invalid number of threads \"%s\"\n", optarg);
+                return 2;
+            }
+            nthreads = n;
+            break;
+
+        case 'o':
+            outdir = optarg;
+            break;
+
+        case 'p':
+            prefix = optarg;
+            break;
+
+        case 'v':
+            log.log_level = NGX_LOG_INFO;
+            break;
+
+        default:
+            fprintf(stderr, "usage: %s [-j threads] [-o dir] [-p prefix] [-v] "
+                            "path...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    pool = ngx_create_pool(NGX_EXPAND_POOL_SIZE, &log);
+    if (pool == NULL
+        || ngx_array_init(&jobs, pool, 64, sizeof(ngx_expand_job_t))
+           != NGX_OK)
+    {
+        return 2;
+    }
+
+    for (c = optind; c < argc; ++c) {
+        if (stat(argv[c], &sb) == -1) {
+            fprintf(stderr, "%s: %s\n", argv[c], strerror(errno));
+            return 2;
+        }
+
+        path = ngx_expand_full_name(pool, argv[c], 0);
+        if (path == NULL) {
+            return 2;
+        }
+
+        rc = S_ISDIR(sb.st_mode)
+             ? ngx_expand_add_dir(&jobs, path, path, outdir)
+             : ngx_expand_add(&jobs, path, NULL, outdir);
+        if (rc != NGX_OK) {
+            return 2;
+        }
+    }
+
+    ngx_qsort(jobs.elts, jobs.nelts, sizeof(ngx_expand_job_t),
+              ngx_expand_cmp_jobs);
+
+    ngx_memzero(&queue, sizeof(queue));
+    queue.jobs = jobs.elts;
+    queue.njobs = jobs.nelts;
+    queue.log_level = log.log_level;
+    if (prefix) {
+        prefix = ngx_expand_full_name(pool, prefix, 1);
+        if (prefix == NULL) {
+            return 2;
+        }
+        queue.prefix.data = (u_char *) prefix;
+        queue.prefix.len = ngx_strlen(prefix);
+    }
+
+    if (nthreads > queue.njobs) {
+        nthreads = queue.njobs ? queue.njobs : 1;
+    }
+
+    tids = ngx_alloc(nthreads * sizeof(pthread_t), &log);
+    if (tids == NULL || pthread_mutex_init(&queue.mtx, NULL) != 0) {
+        return 2;
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&tids[i], NULL, ngx_expand_thread, &queue) != 0) {
+            fprintf(stderr, "pthread_create() failed\n");
+            return 2;
+        }
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    rc = 0;
+    job = jobs.elts;
+
+    for (i = 0; i < jobs.nelts; ++i) {
+        if (job[i].text) {
+            fwrite(job[i].text, 1, job[i].len, stdout);
+            free(job[i].text);
+        }
+        if (job[i].rc != NGX_OK) {
+            rc = 1;
+        }
+        free(job[i].path);
+        free(job[i].out);
+    }
+
+    ngx_free(tids);
+    ngx_destroy_pool(pool);
+
+    return rc;
+}
+
+
+static void *
+ngx_expand_thread(void *data)
+{
+    ngx_expand_queue_t  *queue = data;
+
+    ngx_expand_job_t  *job;
+
+    for ( ;; ) {
+        pthread_mutex_lock(&queue->mtx);
+        job = queue->next < queue->njobs ? &queue->jobs[queue->next++]
+                                         : NULL;
+        pthread_mutex_unlock(&queue->mtx);
+
+        if (job == NULL) {
+            return NULL;
+        }
+
+        job->rc = ngx_expand_job(queue, job);
+    }
+}
+
+
+/* Parses a top-level file in a context of its own, as a fresh cycle. */
+
+static ngx_int_t
+ngx_expand_job(ngx_expand_queue_t *queue, ngx_expand_job_t *job)
+{
+    u_char            *p;
+    ngx_int_t          rc;
+    ngx_str_t          name;
+    ngx_expand_env_t   env;
+
+    ngx_memzero(&env, sizeof(env));
+
+    env.log.log_level = queue->log_level;
+
+    env.out = job->out ? fopen(job->out, "w")
+                       : open_memstream(&job->text, &job->len);
+    if (env.out == NULL) {
+        fprintf(stderr, "%s: %s\n", job->out ? job->out : job->path,
+                strerror(errno));
+        return NGX_ERROR;
+    }
+
+    env.cycle.pool = ngx_create_pool(NGX_EXPAND_POOL_SIZE, &env.log);
+    env.cycle.log = &env.log;
+
+    env.cf.cycle = &env.cycle;
+    env.cf.pool = env.cycle.pool;
+    env.cf.temp_pool = ngx_create_pool(NGX_EXPAND_POOL_SIZE, &env.log);
+    env.cf.log = &env.log;
+    env.cf.args = env.cycle.pool
+                  ? ngx_array_create(env.cycle.pool, 8, sizeof(ngx_str_t))
+                  : NULL;
+
+    if (env.cf.temp_pool == NULL || env.cf.args == NULL) {
+        fclose(env.out);
+        return NGX_ERROR;
+    }
+
+    name.data = (u_char *) job->path;
+    name.len = ngx_strlen(job->path);
+
+    /* as with nginx -c, by default */
+    env.prefix = queue->prefix;
+    if (env.prefix.data == NULL) {
+        env.prefix = name;
+        for (p = name.data + name.len; p > name.data && p[-1] != '/'; --p) {
+            /* void */
+        }
+        env.prefix.len = p - name.data;
+    }
+
+    env.cycle.conf_prefix = env.prefix;
+
+    rc = ngx_expand_parse(&env, &name);
+
+    ngx_destroy_pool(env.cf.temp_pool);
+    ngx_destroy_pool(env.cycle.pool);
+
+    if (fclose(env.out) != 0) {
+        rc = NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+/* ngx_conf_parse(), down to the calls the module's patches add to it. */
+
+static ngx_int_t
+ngx_expand_parse(ngx_expand_env_t *env, ngx_str_t *filename)
+{
+    ngx_fd_t          fd;
+    ngx_int_t         rc;
+    ngx_buf_t         buf;
+    ngx_conf_t       *cf;
+    ngx_conf_file_t  *prev, conf_file;
+
+    cf = &env->cf;
+    prev = NULL;
+    fd = NGX_INVALID_FILE;
+
+    if (filename) {
+        fd = ngx_open_file(filename->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        if (fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_open_file_n " \"%s\" failed",
+                               filename->data);
+            return NGX_ERROR;
+        }
+
+        prev = cf->conf_file;
+
+        ngx_memzero(&conf_file, sizeof(ngx_conf_file_t));
+        conf_file.script_delim = prev ? prev->script_delim : NULL;
+        cf->conf_file = &conf_file;
+
+        if (ngx_fd_info(fd, &cf->conf_file->file.info) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", filename->data);
+        }
+
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
+        cf->conf_file->buffer = &buf;
+        cf->conf_file->file.fd = fd;
+        cf->conf_file->file.name.len = filename->len;
+        cf->conf_file->file.name.data = filename->data;
+        cf->conf_file->file.offset = 0;
+        cf->conf_file->file.log = cf->log;
+        cf->conf_file->line = 1;
+
+        if (ngx_conf_script_file_start(cf) != NGX_OK) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+    }
+
+    for ( ;; ) {
+        rc = ngx_conf_script_read_token(cf, ngx_expand_read_token);
+
+        if (rc == NGX_ERROR) {
+            goto done;
+        }
+
+        if (rc == NGX_CONF_BLOCK_DONE) {
+
+            ngx_conf_script_block_done(cf);
+
+            if (filename) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unexpected \"}\"");
+                rc = NGX_ERROR;
+                goto done;
+            }
+
+            rc = NGX_OK;
+            goto done;
+        }
+
+        if (rc == NGX_CONF_FILE_DONE) {
+
+            if (filename == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unexpected end of file, "
+                                   "expecting \"}\"");
+                rc = NGX_ERROR;
+                goto done;
+            }
+
+            rc = NGX_OK;
+            goto done;
+        }
+
+        if (rc == NGX_CONF_BLOCK_START) {
+            ngx_conf_script_block_start(cf);
+        }
+
+        if (ngx_expand_handler(env, rc) != NGX_OK) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+    }
+
+done:
+
+    if (filename) {
+        ngx_conf_script_file_done(cf);
+
+        if (buf.start) {
+            ngx_free(buf.start);
+        }
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                          ngx_close_file_n " %s failed", filename->data);
+            rc = NGX_ERROR;
+        }
+
+        cf->conf_file = prev;
+    }
+
+    return rc;
+}
+
+
+/* What the module's block directives call to parse their blocks: their
+ * contents are printed at the directive's place. */
+
+char *
+ngx_conf_parse(ngx_conf_t *cf, ngx_str_t *filename)
+{
+    ngx_expand_env_t  *env;
+
+    env = (ngx_expand_env_t *) ((u_char *) cf
+                                - offsetof(ngx_expand_env_t, cf));
+
+    return ngx_expand_parse(env, filename) == NGX_OK ? NGX_CONF_OK
+                                                     : NGX_CONF_ERROR;
+}
+
+
+/* The module's directives run, include is followed, and any other
+ * directive gets its arguments expanded and printed. */
+
+static ngx_int_t
+ngx_expand_handler(ngx_expand_env_t *env, ngx_int_t last)
+{
+    ngx_str_t      *name;
+    ngx_uint_t      i;
+    ngx_command_t  *cmd;
+
+    name = env->cf.args->elts;
+
+    for (cmd = ngx_conf_script_module.commands; cmd->name.len; ++cmd) {
+        if (name->len == cmd->name.len
+            && ngx_strcmp(name->data, cmd->name.data) == 0)
+        {
+            return ngx_expand_command(env, cmd, last);
+        }
+    }
+
+    if (last == NGX_OK && env->cf.args->nelts == 2
+        && name->len == sizeof("include") - 1
+        && ngx_strcmp(name->data, "include") == 0)
+    {
+        return ngx_expand_include(env);
+    }
+
+    for (i = 1; i < env->cf.args->nelts; ++i) {
+        if (ngx_conf_complex_value_shared(&env->cf, &name[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_expand_print(env, last);
+
+    if (last != NGX_CONF_BLOCK_START) {
+        return NGX_OK;
+    }
+
+    ++env->depth;
+
+    if (ngx_expand_parse(env, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    --env->depth;
+
+    ngx_expand_indent(env);
+    fputs("}\n", env->out);
+
+    return NGX_OK;
+}
+
+
+/* The checks of ngx_conf_handler() that apply to the module's
+ * directives. */
+
+static ngx_int_t
+ngx_expand_command(ngx_expand_env_t *env, ngx_command_t *cmd,
+    ngx_int_t last)
+{
+    char        *rv;
+    ngx_conf_t  *cf;
+    ngx_uint_t   valid;
+
+    cf = &env->cf;
+
+    if (env->depth && (cmd->type & NGX_ANY_CONF) == NGX_MAIN_CONF) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" directive is not allowed here",
+                           &cmd->name);
+        return NGX_ERROR;
+    }
+
+    if (!(cmd->type & NGX_CONF_BLOCK) && last != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "directive \"%V\" is not terminated by \";\"",
+                           &cmd->name);
+        return NGX_ERROR;
+    }
+
+    if ((cmd->type & NGX_CONF_BLOCK) && last != NGX_CONF_BLOCK_START) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "directive \"%V\" has no opening \"{\"",
+                           &cmd->name);
+        return NGX_ERROR;
+    }
+
+    if (cmd->type & NGX_CONF_ANY) {
+        valid = 1;
+
+    } else if (cmd->type & NGX_CONF_FLAG) {
+        valid = (cf->args->nelts == 2);
+
+    } else if (cmd->type & NGX_CONF_1MORE) {
+        valid = (cf->args->nelts >= 2);
+
+    } else if (cmd->type & NGX_CONF_2MORE) {
+        valid = (cf->args->nelts >= 3);
+
+    } else if (cf->args->nelts > NGX_CONF_MAX_ARGS) {
+        valid = 0;
+
+    } else {
+        valid = (cmd->type & argument_number[cf->args->nelts - 1]) != 0;
+    }
+
+    if (!valid) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"%V\" directive",
+                           &cmd->name);
+        return NGX_ERROR;
+    }
+
+    rv = cmd->set(cf, cmd, NULL);
+
+    if (rv == NGX_CONF_OK) {
+        return NGX_OK;
+    }
+
+    if (rv != NGX_CONF_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" directive %s", &cmd->name, rv);
+    }
+
+    return NGX_ERROR;
+}
+
+
+/* ngx_conf_include(), inlining the files. */
+
+static ngx_int_t
+ngx_expand_include(ngx_expand_env_t *env)
+{
+    u_char      *p;
+    ngx_int_t    rc;
+    ngx_str_t   *value, file, name;
+    ngx_glob_t   gl;
+    ngx_conf_t  *cf;
+
+    cf = &env->cf;
+    value = cf->args->elts;
+    file = value[1];
+
+    if (ngx_conf_complex_value_shared(cf, &file) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (file.len == 0 || file.data[0] != '/') {
+        p = ngx_pnalloc(cf->pool, env->prefix.len + file.len + 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(p, env->prefix.data, env->prefix.len);
+        ngx_memcpy(p + env->prefix.len, file.data, file.len);
+        p[env->prefix.len + file.len] = '\0';
+        file.data = p;
+        file.len += env->prefix.len;
+
+    } else if (file.data[file.len] != '\0') {
+        file.data = ngx_pstrdup(cf->pool, &file);
+        if (file.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (strpbrk((char *) file.data, "*?[") == NULL) {
+        ngx_expand_indent(env);
+        fprintf(env->out, "# %s\n", file.data);
+
+        return ngx_expand_parse(env, &file);
+    }
+
+    ngx_memzero(&gl, sizeof(ngx_glob_t));
+
+    gl.pattern = file.data;
+    gl.log = cf->log;
+    gl.test = 1;
+
+    if (ngx_open_glob(&gl) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "glob() \"%s\" failed", file.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_conf_script_prefetch_glob(cf, &file) != NGX_OK) {
+        ngx_close_glob(&gl);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_OK;
+
+    for ( ;; ) {
+        if (ngx_read_glob(&gl, &name) != NGX_OK) {
+            break;
+        }
+
+        file.len = name.len++;
+        file.data = ngx_pstrdup(cf->pool, &name);
+        if (file.data == NULL) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        ngx_expand_indent(env);
+        fprintf(env->out, "# %s\n", file.data);
+
+        rc = ngx_expand_parse(env, &file);
+        if (rc != NGX_OK) {
+            break;
+        }
+    }
+
+    ngx_close_glob(&gl);
+
+    return rc;
+}
+
+
+/* ngx_conf_read_token(), from the whole file read at once. */
+
+static ngx_int_t
+ngx_expand_read_token(ngx_conf_t *cf)
+{
+    u_char      ch, *dst, *src, *start;
+    size_t      len;
+    ngx_str_t  *word;
+    ngx_buf_t  *b;
+    ngx_uint_t  found, need_space, last_space, sharp_comment, variable;
+    ngx_uint_t  quoted, s_quoted, d_quoted;
+
+    found = 0;
+    need_space = 0;
+    last_space = 1;
+    sharp_comment = 0;
+    variable = 0;
+    quoted = 0;
+    s_quoted = 0;
+    d_quoted = 0;
+
+    cf->args->nelts = 0;
+    b = cf->conf_file->buffer;
+    start = b->pos;
+
+    if (b->start == NULL) {
+        if (ngx_expand_load(cf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        start = b->pos;
+    }
+
+    for ( ;; ) {
+
+        if (b->pos >= b->last) {
+
+            if (cf->args->nelts > 0 || !last_space) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unexpected end of file, "
+                                   "expecting \";\" or \"}\"");
+                return NGX_ERROR;
+            }
+
+            return NGX_CONF_FILE_DONE;
+        }
+
+        ch = *b->pos++;
+
+        if (ch == LF) {
+            cf->conf_file->line++;
+
+            if (sharp_comment) {
+                sharp_comment = 0;
+            }
+        }
+
+        if (sharp_comment) {
+            continue;
+        }
+
+        if (quoted) {
+            quoted = 0;
+            continue;
+        }
+
+        if (need_space) {
+            if (ch == ' ' || ch == '\t' || ch == CR || ch == LF) {
+                last_space = 1;
+                need_space = 0;
+                continue;
+            }
+
+            if (ch == ';') {
+                return NGX_OK;
+            }
+
+            if (ch == '{') {
+                return NGX_CONF_BLOCK_START;
+            }
+
+            if (ch == ')') {
+                last_space = 1;
+                need_space = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unexpected \"%c\"", ch);
+                return NGX_ERROR;
+            }
+        }
+
+        if (last_space) {
+
+            start = b->pos - 1;
+
+            if (ch == ' ' || ch == '\t' || ch == CR || ch == LF) {
+                continue;
+            }
+
+            switch (ch) {
+
+            case ';':
+            case '{':
+                if (cf->args->nelts == 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "unexpected \"%c\"", ch);
+                    return NGX_ERROR;
+                }
+
+                if (ch == '{') {
+                    return NGX_CONF_BLOCK_START;
+                }
+
+                return NGX_OK;
+
+            case '}':
+                if (cf->args->nelts != 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "unexpected \"}\"");
+                    return NGX_ERROR;
+                }
+
+                return NGX_CONF_BLOCK_DONE;
+
+            case '#':
+                sharp_comment = 1;
+                continue;
+
+            case '\\':
+                quoted = 1;
+                last_space = 0;
+                continue;
+
+            case '"':
+                start++;
+                d_quoted = 1;
+                last_space = 0;
+                continue;
+
+            case '\'':
+                start++;
+                s_quoted = 1;
+                last_space = 0;
+                continue;
+
+            case '$':
+                variable = 1;
+                last_space = 0;
+                continue;
+
+            default:
+                last_space = 0;
+            }
+
+        } else {
+            if (ch == '{' && variable) {
+                continue;
+            }
+
+            variable = 0;
+
+            if (ch == '\\') {
+                quoted = 1;
+                continue;
+            }
+
+            if (ch == '$') {
+                variable = 1;
+                continue;
+            }
+
+            if (d_quoted) {
+                if (ch == '"') {
+                    d_quoted = 0;
+                    need_space = 1;
+                    found = 1;
+                }
+
+            } else if (s_quoted) {
+                if (ch == '\'') {
+                    s_quoted = 0;
+                    need_space = 1;
+                    found = 1;
+                }
+
+            } else if (ch == ' ' || ch == '\t' || ch == CR || ch == LF
+                       || ch == ';' || ch == '{')
+            {
+                last_space = 1;
+                found = 1;
+            }
+
+            if (found) {
+                word = ngx_array_push(cf->args);
+                if (word == NULL) {
+                    return NGX_ERROR;
+                }
+
+                word->data = ngx_pnalloc(cf->pool, b->pos - 1 - start + 1);
+                if (word->data == NULL) {
+                    return NGX_ERROR;
+                }
+
+                for (dst = word->data, src = start, len = 0;
+                     src < b->pos - 1;
+                     len++)
+                {
+                    if (*src == '\\') {
+                        switch (src[1]) {
+                        case '"':
+                        case '\'':
+                        case '\\':
+                            src++;
+                            break;
+
+                        case 't':
+                            *dst++ = '\t';
+                            src += 2;
+                            continue;
+
+                        case 'r':
+                            *dst++ = '\r';
+                            src += 2;
+                            continue;
+
+                        case 'n':
+                            *dst++ = '\n';
+                            src += 2;
+                            continue;
+                        }
+
+                    }
+                    *dst++ = *src++;
+                }
+                *dst = '\0';
+                word->len = len;
+
+                if (ch == ';') {
+                    return NGX_OK;
+                }
+
+                if (ch == '{') {
+                    return NGX_CONF_BLOCK_START;
+                }
+
+                found = 0;
+            }
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_expand_load(ngx_conf_t *cf)
+{
+    off_t       size;
+    ssize_t     n;
+    ngx_buf_t  *b;
+
+    b = cf->conf_file->buffer;
+    size = ngx_file_size(&cf->conf_file->file.info);
+
+    b->start = ngx_alloc(size + 1, cf->log);
+    if (b->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size + 1;
+
+    while (b->last - b->start < size) {
+        n = ngx_conf_script_read_file(cf, b->last, size - (b->last - b->start),
+                                      b->last - b->start);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_read_file_n " \"%V\" failed",
+                               &cf->conf_file->file.name);
+            return NGX_ERROR;
+        }
+        b->last += n;
+    }
+
+    return NGX_OK;
+}
+
+
+/* Quotes what nginx would not read back as a single word. */
+
+static void
+ngx_expand_print(ngx_expand_env_t *env, ngx_int_t last)
+{
+    u_char      *p;
+    ngx_str_t   *args;
+    ngx_uint_t   i;
+
+    args = env->cf.args->elts;
+
+    ngx_expand_indent(env);
+
+    for (i = 0; i < env->cf.args->nelts; ++i) {
+        if (i) {
+            fputc(' ', env->out);
+        }
+
+        for (p = args[i].data; p < args[i].data + args[i].len; ++p) {
+            if (ngx_strchr(" \t\r\n;{}\"'\\#", *p) || *p == '\0') {
+                break;
+            }
+        }
+
+        if (args[i].len && p == args[i].data + args[i].len) {
+            fwrite(args[i].data, 1, args[i].len, env->out);
+            continue;
+        }
+
+        fputc('"', env->out);
+        for (p = args[i].data; p < args[i].data + args[i].len; ++p) {
+            if (*p == '"' || *p == '\\') {
+                fputc('\\', env->out);
+            }
+            fputc(*p, env->out);
+        }
+        fputc('"', env->out);
+    }
+
+    fputs(last == NGX_CONF_BLOCK_START ? " {\n" : ";\n", env->out);
+}
+
+
+static void
+ngx_expand_indent(ngx_expand_env_t *env)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < env->depth; ++i) {
+        fputs("    ", env->out);
+    }
+}
+
+
+static ngx_int_t
+ngx_expand_add(ngx_array_t *jobs, char *path, char *root, char *outdir)
+{
+    char              *rel;
+    size_t             len;
+    ngx_expand_job_t  *job;
+
+    job = ngx_array_push(jobs);
+    if (job == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(job, sizeof(ngx_expand_job_t));
+    job->path = strdup(path);
+    if (job->path == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (outdir == NULL) {
+        return NGX_OK;
+    }
+
+    /* relative to the directory given, else only the file's name */
+    if (root) {
+        rel = path + strlen(root);
+
+    } else {
+        rel = strrchr(path, '/');
+        rel = rel ? rel : path;
+    }
+
+    while (*rel == '/') {
+        ++rel;
+    }
+
+    len = strlen(outdir) + 1 + strlen(rel) + 1;
+    job->out = malloc(len);
+    if (job->out == NULL) {
+        return NGX_ERROR;
+    }
+    snprintf(job->out, len, "%s/%s", outdir, rel);
+
+    return ngx_expand_mkdirs(job->out);
+}
+
+
+static ngx_int_t
+ngx_expand_add_dir(ngx_array_t *jobs, char *dir, char *root, char *outdir)
+{
+    char           *path;
+    size_t          len;
+    DIR            *d;
+    ngx_int_t       rc;
+    struct stat     sb;
+    struct dirent  *de;
+
+    d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return NGX_ERROR;
+    }
+
+    rc = NGX_OK;
+
+    while (rc == NGX_OK && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        len = strlen(dir) + 1 + strlen(de->d_name) + 1;
+        path = malloc(len);
+        if (path == NULL) {
+            rc = NGX_ERROR;
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir, de->d_name);
+
+        if (stat(path, &sb) == -1) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            rc = NGX_ERROR;
+
+        } else if (S_ISDIR(sb.st_mode)) {
+            rc = ngx_expand_add_dir(jobs, path, root, outdir);
+
+        } else if (len > sizeof(".conf")
+                   && strcmp(path + len - sizeof(".conf"), ".conf") == 0)
+        {
+            rc = ngx_expand_add(jobs, path, root, outdir);
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_expand_mkdirs(char *path)
+{
+    char  *p;
+
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            *p = '/';
+            return NGX_ERROR;
+        }
+        *p = '/';
+    }
+
+    return NGX_OK;
+}
+
+
+/* Prepends the current directory to a relative path, as nginx does with
+ * its prefix (ngx_conf_full_name()), so that . and messages name files as
+ * in nginx; a directory gets a trailing slash. */
+
+static char *
+ngx_expand_full_name(ngx_pool_t *pool, char *path, ngx_uint_t dir)
+{
+    char    *full, *cwd;
+    size_t   len;
+
+    cwd = NULL;
+
+    if (path[0] != '/') {
+        while (path[0] == '.' && path[1] == '/') {
+            for (path += 2; *path == '/'; ++path) { /* void */ }
+        }
+
+        if (path[0] == '.' && path[1] == '\0') {
+            path++;
+        }
+
+        cwd = getcwd(NULL, 0);
+        if (cwd == NULL) {
+            fprintf(stderr, "getcwd(): %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+
+    len = (cwd ? strlen(cwd) + 1 : 0) + strlen(path);
+
+    full = ngx_pnalloc(pool, len + 2);
+    if (full == NULL) {
+        free(cwd);
+        return NULL;
+    }
+
+    if (cwd) {
+        sprintf(full, *path ? "%s/%s" : "%s", cwd, path);
+        len -= (*path == '\0');
+        free(cwd);
+
+    } else {
+        strcpy(full, path);
+    }
+
+    if (dir && len && full[len - 1] != '/') {
+        full[len++] = '/';
+        full[len] = '\0';
+    }
+
+    return full;
+}
+
+
+static int
+ngx_expand_cmp_jobs(const void *one, const void *two)
+{
+    const ngx_expand_job_t  *a = one, *b = two;
+
+    return strcmp(a->path, b->path);
+}
@@ -0,0 +1,36 @@
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <glob.h>
+#if (NGX_THREADS)
+#include <pthread.h>
+#endif
+
+typedef intptr_t        ngx_int_t;
+typedef uintptr_t       ngx_uint_t;
+typedef intptr_t        ngx_flag_t;
+
+#define NGX_INT_T_LEN   (sizeof("-9223372036854775808") - 1)
+#define NGX_OFF_T_LEN   (sizeof("-9223372036854775808") - 1)
+#define NGX_MAX_INT_T_VALUE  9223372036854775807
+#define NGX_ALIGNMENT   sizeof(unsigned long)
+#define ngx_align(d, a)     (((d) + (a - 1)) & ~(a - 1))
+#define ngx_align_ptr(p, a)                                                   \
+    (u_char *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Minimal stand-in for nginx's core headers: just enough of pools, arrays,
+ * strings, logging and the (patched) ngx_conf_t / ngx_cycle_t to build the
+ * config-script evaluator outside of an nginx tree.
+ */
+
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+typedef unsigned char               u_char;
+
+typedef struct ngx_module_s         ngx_module_t;
+typedef struct ngx_conf_s           ngx_conf_t;
+typedef struct ngx_cycle_s          ngx_cycle_t;
+typedef struct ngx_pool_s           ngx_pool_t;
+typedef struct ngx_log_s            ngx_log_t;
+typedef struct ngx_command_s        ngx_command_t;
+typedef struct ngx_file_s           ngx_file_t;
+
+typedef int                         ngx_fd_t;
+typedef int                         ngx_err_t;
+typedef struct stat                 ngx_file_info_t;
+typedef ngx_uint_t                  ngx_msec_t;
+
+#define  NGX_OK          0
+#define  NGX_ERROR      -1
+#define  NGX_AGAIN      -2
+#define  NGX_BUSY       -3
+#define  NGX_DONE       -4
+#define  NGX_DECLINED   -5
+#define  NGX_ABORT      -6
+
+#define NGX_INVALID_FILE         -1
+#define NGX_FILE_ERROR           -1
+
+#define LF     (u_char) '\n'
+#define CR     (u_char) '\r'
+#define CRLF   "\r\n"
+
+#define ngx_errno                errno
+#define ngx_abs(value)       (((value) >= 0) ? (value) : - (value))
+#define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
+#define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
+
+
+/* strings */
+
+typedef struct {
+    size_t      len;
+    u_char     *data;
+} ngx_str_t;
+
+#define ngx_string(str)     { sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string     { 0, NULL }
+#define ngx_str_set(str, text)                                               \
+    (str)->len = sizeof(text) - 1; (str)->data = (u_char *) text
+#define ngx_str_null(str)   (str)->len = 0; (str)->data = NULL
+
+#define ngx_tolower(c)      (u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+#define ngx_strncmp(s1, s2, n)  strncmp((const char *) s1, (const char *) s2, n)
+#define ngx_strcmp(s1, s2)  strcmp((const char *) s1, (const char *) s2)
+#define ngx_strlen(s)       strlen((const char *) s)
+#define ngx_strchr(s1, c)   strchr((const char *) s1, (int) c)
+#define ngx_strlchr(p, last, c)                                               \
+    ((u_char *) memchr(p, c, (last) - (p)))
+#define ngx_memzero(buf, n)       (void) memset(buf, 0, n)
+#define ngx_memset(buf, c, n)     (void) memset(buf, c, n)
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n)   (((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_copy                  ngx_cpymem
+#define ngx_memmove(dst, src, n)  (void) memmove(dst, src, n)
+#define ngx_movemem(dst, src, n)  (((u_char *) memmove(dst, src, n)) + (n))
+#define ngx_memcmp(s1, s2, n)     memcmp((const char *) s1, (const char *) s2, n)
+
+ngx_int_t ngx_strcasecmp(u_char *s1, u_char *s2);
+ngx_int_t ngx_atoi(u_char *line, size_t n);
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
+u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt,
+    va_list args);
+
+#define ngx_qsort           qsort
+
+#define ngx_hash(key, c)    ((ngx_uint_t) key * 31 + c)
+ngx_uint_t ngx_hash_key(u_char *data, size_t len);
+
+
+/* memory */
+
+#define ngx_alloc(size, log)      malloc(size)
+#define ngx_calloc(size, log)     calloc(1, size)
+#define ngx_free                  free
+
+typedef void (*ngx_pool_cleanup_pt)(void *data);
+
+typedef struct ngx_pool_cleanup_s  ngx_pool_cleanup_t;
+
+struct ngx_pool_cleanup_s {
+    ngx_pool_cleanup_pt   handler;
+    void                 *data;
+    ngx_pool_cleanup_t   *next;
+};
+
+typedef struct ngx_pool_block_s  ngx_pool_block_t;
+
+struct ngx_pool_s {
+    ngx_pool_block_t     *blocks;
+    ngx_pool_cleanup_t   *cleanup;
+    ngx_log_t            *log;
+    size_t                allocated;     /* stub only: bytes handed out */
+};
+
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+void ngx_destroy_pool(ngx_pool_t *pool);
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pnalloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
+u_char *ngx_pstrdup(ngx_pool_t *pool, ngx_str_t *src);
+u_char *ngx_cpystrn(u_char *dst, u_char *src, size_t n);
+
+
+/* arrays */
+
+typedef struct {
+    void        *elts;
+    ngx_uint_t   nelts;
+    size_t       size;
+    ngx_uint_t   nalloc;
+    ngx_pool_t  *pool;
+} ngx_array_t;
+
+ngx_array_t *ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size);
+void ngx_array_destroy(ngx_array_t *a);
+void *ngx_array_push(ngx_array_t *a);
+void *ngx_array_push_n(ngx_array_t *a, ngx_uint_t n);
+
+static inline ngx_int_t
+ngx_array_init(ngx_array_t *array, ngx_pool_t *pool, ngx_uint_t n, size_t size)
+{
+    array->nelts = 0;
+    array->size = size;
+    array->nalloc = n;
+    array->pool = pool;
+
+    array->elts = ngx_palloc(pool, n * size);
+    if (array->elts == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* logs */
+
+#define NGX_LOG_STDERR            0
+#define NGX_LOG_EMERG             1
+#define NGX_LOG_ALERT             2
+#define NGX_LOG_CRIT              3
+#define NGX_LOG_ERR               4
+#define NGX_LOG_WARN              5
+#define NGX_LOG_NOTICE            6
+#define NGX_LOG_INFO              7
+#define NGX_LOG_DEBUG             8
+
+#define NGX_LOG_DEBUG_CORE        0x010
+
+struct ngx_log_s {
+    ngx_uint_t           log_level;
+};
+
+void ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...);
+void ngx_log_debug_core(ngx_log_t *log, ngx_err_t err, const char *fmt, ...);
+
+#define ngx_log_debug0(level, log, err, fmt)                                 \
+    ngx_log_debug_core(log, err, fmt)
+#define ngx_log_debug1(level, log, err, fmt, a1)                             \
+    ngx_log_debug_core(log, err, fmt, a1)
+#define ngx_log_debug2(level, log, err, fmt, a1, a2)                         \
+    ngx_log_debug_core(log, err, fmt, a1, a2)
+#define ngx_log_debug3(level, log, err, fmt, a1, a2, a3)                     \
+    ngx_log_debug_core(log, err, fmt, a1, a2, a3)
+#define ngx_log_debug4(level, log, err, fmt, a1, a2, a3, a4)                 \
+    ngx_log_debug_core(log, err, fmt, a1, a2, a3, a4)
+#define ngx_log_debug5(level, log, err, fmt, a1, a2, a3, a4, a5)             \
+    ngx_log_debug_core(log, err, fmt, a1, a2, a3, a4, a5)
+#define ngx_log_debug6(level, log, err, fmt, a1, a2, a3, a4, a5, a6)         \
+    ngx_log_debug_core(log, err, fmt, a1, a2, a3, a4, a5, a6)
+
+
+/* files */
+
+struct ngx_file_s {
+    ngx_fd_t             fd;
+    ngx_str_t            name;
+    ngx_file_info_t      info;
+    off_t                offset;
+    ngx_log_t           *log;
+};
+
+typedef struct {
+    u_char              *pos;
+    u_char              *last;
+    u_char              *start;
+    u_char              *end;
+} ngx_buf_t;
+
+#define ngx_open_file(name, mode, create, access)                            \
+    open((const char *) name, mode|create, access)
+#define NGX_FILE_RDONLY          O_RDONLY
+#define NGX_FILE_WRONLY          O_WRONLY
+#define NGX_FILE_OPEN            0
+#define NGX_FILE_TRUNCATE        (O_CREAT|O_TRUNC)
+#define NGX_FILE_DEFAULT_ACCESS  0644
+#define ngx_open_file_n          "open()"
+#define ngx_close_file           close
+#define ngx_close_file_n         "close()"
+#define ngx_fd_info(fd, sb)      fstat(fd, sb)
+#define ngx_fd_info_n            "fstat()"
+#define ngx_file_info(file, sb)  stat((const char *) file, sb)
+#define ngx_file_info_n          "stat()"
+#define ngx_file_size(sb)        (sb)->st_size
+#define ngx_file_mtime(sb)       (sb)->st_mtime
+#define ngx_file_uniq(sb)        (sb)->st_ino
+#define ngx_read_fd              read
+#define ngx_read_fd_n            "read()"
+#define ngx_read_file_n          "pread()"
+ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size,
+    off_t offset);
+#define ngx_write_fd             write
+#define ngx_write_fd_n           "write()"
+#define ngx_rename_file(o, n)    rename((const char *) o, (const char *) n)
+#define ngx_rename_file_n        "rename()"
+#define ngx_delete_file(name)    unlink((const char *) name)
+#define ngx_delete_file_n        "unlink()"
+
+typedef struct {
+    size_t               n;
+    glob_t               pglob;
+    u_char              *pattern;
+    ngx_log_t           *log;
+    ngx_uint_t           test;
+} ngx_glob_t;
+
+ngx_int_t ngx_open_glob(ngx_glob_t *gl);
+ngx_int_t ngx_read_glob(ngx_glob_t *gl, ngx_str_t *name);
+void ngx_close_glob(ngx_glob_t *gl);
+
+
+/* threads */
+
+#if (NGX_THREADS)
+
+typedef pthread_mutex_t  ngx_thread_mutex_t;
+typedef pthread_cond_t   ngx_thread_cond_t;
+
+#define ngx_thread_mutex_create(mtx, log)                                         (pthread_mutex_init(mtx, NULL) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_destroy(mtx, log)                                        (pthread_mutex_destroy(mtx) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_lock(mtx, log)                                           (pthread_mutex_lock(mtx) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_unlock(mtx, log)                                         (pthread_mutex_unlock(mtx) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_create(cond, log)                                         (pthread_cond_init(cond, NULL) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_destroy(cond, log)                                        (pthread_cond_destroy(cond) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_signal(cond, log)                                         (pthread_cond_signal(cond) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_wait(cond, mtx, log)                                      (pthread_cond_wait(cond, mtx) ? NGX_ERROR : NGX_OK)
+
+#endif
+
+
+/* time */
+
+#define ngx_gettimeofday(tp)     (void) gettimeofday(tp, NULL)
+
+
+/* configuration */
+
+#define NGX_CONF_NOARGS      0x00000001
+#define NGX_CONF_TAKE1       0x00000002
+#define NGX_CONF_TAKE2       0x00000004
+#define NGX_CONF_TAKE3       0x00000008
+#define NGX_CONF_TAKE4       0x00000010
+#define NGX_CONF_TAKE5       0x00000020
+#define NGX_CONF_TAKE6       0x00000040
+#define NGX_CONF_TAKE7       0x00000080
+
+#define NGX_CONF_MAX_ARGS    8
+
+#define NGX_CONF_TAKE12      (NGX_CONF_TAKE1|NGX_CONF_TAKE2)
+#define NGX_CONF_TAKE13      (NGX_CONF_TAKE1|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE23      (NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE123     (NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE1234    (NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_TAKE3   \
+                              |NGX_CONF_TAKE4)
+
+#define NGX_CONF_ARGS_NUMBER 0x000000ff
+#define NGX_CONF_BLOCK       0x00000100
+#define NGX_CONF_FLAG        0x00000200
+#define NGX_CONF_ANY         0x00000400
+#define NGX_CONF_1MORE       0x00000800
+#define NGX_CONF_2MORE       0x00001000
+
+#define NGX_DIRECT_CONF      0x00010000
+#define NGX_MAIN_CONF        0x01000000
+#define NGX_ANY_CONF         0xFF000000
+
+#define NGX_CONF_OK          NULL
+#define NGX_CONF_ERROR       (void *) -1
+
+#define NGX_CONF_BLOCK_START 1
+#define NGX_CONF_BLOCK_DONE  2
+#define NGX_CONF_FILE_DONE   3
+
+#define NGX_CONF_MODULE      0x464E4F43  /* "CONF" */
+
+#define NGX_CONF_UNSET       -1
+#define NGX_CONF_UNSET_UINT  (ngx_uint_t) -1
+
+#include <ngx_conf_def.h>
+
+typedef struct {
+    ngx_file_t            file;
+    ngx_buf_t            *buffer;
+    ngx_buf_t            *dump;
+    ngx_uint_t            line;
+    ngx_conf_script_delim_t *script_delim;
+} ngx_conf_file_t;
+
+typedef char *(*ngx_conf_handler_pt)(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+
+struct ngx_conf_s {
+    char                 *name;
+    ngx_array_t          *args;
+
+    ngx_cycle_t          *cycle;
+    ngx_pool_t           *pool;
+    ngx_pool_t           *temp_pool;
+    ngx_conf_file_t      *conf_file;
+    ngx_log_t            *log;
+
+    void                 *ctx;
+    ngx_uint_t            module_type;
+    ngx_uint_t            cmd_type;
+
+    ngx_conf_handler_pt   handler;
+    void                 *handler_conf;
+
+    ngx_conf_script_vars_t *vars;
+};
+
+void ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+    const char *fmt, ...);
+ngx_int_t ngx_conf_full_name(ngx_cycle_t *cycle, ngx_str_t *name,
+    ngx_uint_t conf_prefix);
+/* left to the program, which parses as it sees fit */
+char *ngx_conf_parse(ngx_conf_t *cf, ngx_str_t *filename);
+
+struct ngx_command_s {
+    ngx_str_t             name;
+    ngx_uint_t            type;
+    char               *(*set)(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+    ngx_uint_t            conf;
+    ngx_uint_t            offset;
+    void                 *post;
+};
+
+#define ngx_null_command  { ngx_null_string, 0, NULL, 0, 0, NULL }
+
+struct ngx_cycle_s {
+    ngx_pool_t               *pool;
+    ngx_log_t                *log;
+    ngx_cycle_t              *old_cycle;
+    ngx_str_t                 conf_file;
+    ngx_uint_t                conf_block_level;
+    ngx_conf_script_ctx_t    *conf_script;
+    ngx_conf_script_store_t  *conf_script_store;
+    ngx_str_t                 conf_param;
+    ngx_str_t                 conf_prefix;
+    ngx_str_t                 prefix;
+};
+
+
+#endif /* _NGX_CORE_H_INCLUDED_ */
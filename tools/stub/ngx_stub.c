@@ -0,0 +1,635 @@
+
+/*
+ * Minimal implementations backing stub/ngx_core.h, for building the
+ * config-script evaluator outside of an nginx tree.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_md5.h>
+
+
+#define NGX_STUB_POOL_BLOCK  16384
+
+
+struct ngx_pool_block_s {
+    ngx_pool_block_t  *next;
+    u_char            *pos;
+    u_char            *end;
+};
+
+
+ngx_pool_t *
+ngx_create_pool(size_t size, ngx_log_t *log)
+{
+    ngx_pool_t  *p;
+
+    p = calloc(1, sizeof(ngx_pool_t));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p->log = log;
+
+    return p;
+}
+
+
+void
+ngx_destroy_pool(ngx_pool_t *pool)
+{
+    ngx_pool_block_t    *b, *next;
+    ngx_pool_cleanup_t  *c;
+
+    for (c = pool->cleanup; c; c = c->next) {
+        if (c->handler) {
+            c->handler(c->data);
+        }
+    }
+
+    for (b = pool->blocks; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+
+    free(pool);
+}
+
+
+void *
+ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+    u_char            *p;
+    size_t             block_size;
+    ngx_pool_block_t  *b;
+
+    pool->allocated += size;
+
+    b = pool->blocks;
+    size = ngx_align(size, NGX_ALIGNMENT);
+
+    if (b == NULL || (size_t) (b->end - b->pos) < size) {
+        block_size = ngx_max(size, NGX_STUB_POOL_BLOCK);
+
+        b = malloc(sizeof(ngx_pool_block_t) + NGX_ALIGNMENT + block_size);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->pos = ngx_align_ptr((u_char *) &b[1], NGX_ALIGNMENT);
+        b->end = b->pos + block_size;
+
+        if (pool->blocks && block_size > NGX_STUB_POOL_BLOCK) {
+            /* large allocations do not take the current block's place */
+            b->next = pool->blocks->next;
+            pool->blocks->next = b;
+            b->pos = b->end;
+            return b->end - block_size;
+        }
+
+        b->next = pool->blocks;
+        pool->blocks = b;
+    }
+
+    p = b->pos;
+    b->pos += size;
+
+    return p;
+}
+
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return ngx_palloc(pool, size);
+}
+
+
+void *
+ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    p = ngx_palloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+ngx_int_t
+ngx_pfree(ngx_pool_t *pool, void *p)
+{
+    return NGX_DECLINED;
+}
+
+
+ngx_pool_cleanup_t *
+ngx_pool_cleanup_add(ngx_pool_t *p, size_t size)
+{
+    ngx_pool_cleanup_t  *c;
+
+    c = ngx_palloc(p, sizeof(ngx_pool_cleanup_t));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    if (size) {
+        c->data = ngx_palloc(p, size);
+        if (c->data == NULL) {
+            return NULL;
+        }
+
+    } else {
+        c->data = NULL;
+    }
+
+    c->handler = NULL;
+    c->next = p->cleanup;
+    p->cleanup = c;
+
+    return c;
+}
+
+
+u_char *
+ngx_cpystrn(u_char *dst, u_char *src, size_t n)
+{
+    if (n == 0) {
+        return dst;
+    }
+
+    while (--n) {
+        *dst = *src;
+
+        if (*dst == '\0') {
+            return dst;
+        }
+
+        dst++;
+        src++;
+    }
+
+    *dst = '\0';
+
+    return dst;
+}
+
+
+u_char *
+ngx_pstrdup(ngx_pool_t *pool, ngx_str_t *src)
+{
+    u_char  *dst;
+
+    dst = ngx_pnalloc(pool, src->len);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(dst, src->data, src->len);
+
+    return dst;
+}
+
+
+ngx_array_t *
+ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size)
+{
+    ngx_array_t  *a;
+
+    a = ngx_palloc(p, sizeof(ngx_array_t));
+    if (a == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(a, p, n, size) != NGX_OK) {
+        return NULL;
+    }
+
+    return a;
+}
+
+
+void
+ngx_array_destroy(ngx_array_t *a)
+{
+}
+
+
+void *
+ngx_array_push(ngx_array_t *a)
+{
+    return ngx_array_push_n(a, 1);
+}
+
+
+void *
+ngx_array_push_n(ngx_array_t *a, ngx_uint_t n)
+{
+    void        *elt, *new;
+    ngx_uint_t   nalloc;
+
+    if (a->nelts + n > a->nalloc) {
+        nalloc = 2 * ((n >= a->nalloc) ? n : a->nalloc);
+
+        new = ngx_palloc(a->pool, nalloc * a->size);
+        if (new == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(new, a->elts, a->nelts * a->size);
+        a->elts = new;
+        a->nalloc = nalloc;
+    }
+
+    elt = (u_char *) a->elts + a->size * a->nelts;
+    a->nelts += n;
+
+    return elt;
+}
+
+
+ngx_int_t
+ngx_strcasecmp(u_char *s1, u_char *s2)
+{
+    return strcasecmp((const char *) s1, (const char *) s2);
+}
+
+
+ngx_int_t
+ngx_atoi(u_char *line, size_t n)
+{
+    ngx_int_t  value;
+
+    if (n == 0) {
+        return NGX_ERROR;
+    }
+
+    for (value = 0; n--; line++) {
+        if (*line < '0' || *line > '9') {
+            return NGX_ERROR;
+        }
+
+        value = value * 10 + (*line - '0');
+    }
+
+    return value;
+}
+
+
+ngx_uint_t
+ngx_hash_key(u_char *data, size_t len)
+{
+    ngx_uint_t  i, key;
+
+    key = 0;
+
+    for (i = 0; i < len; i++) {
+        key = ngx_hash(key, data[i]);
+    }
+
+    return key;
+}
+
+
+/*
+ * Only the formats used by the module: %V, %s, %*s, %d, %i, %ui, %uz, %z,
+ * %O, %T, %M, %c, %p and %%.
+ */
+
+u_char *
+ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+    int         n;
+    char        tmp[64];
+    ngx_str_t  *v;
+    u_char     *p;
+    size_t      len, slen, width;
+    u_char      zero;
+    ngx_uint_t  unsig;
+
+    while (*fmt && buf < last) {
+
+        if (*fmt != '%') {
+            *buf++ = *fmt++;
+            continue;
+        }
+
+        fmt++;
+        unsig = 0;
+        slen = (size_t) -1;
+
+        zero = (*fmt == '0');
+        for (width = 0; *fmt >= '0' && *fmt <= '9'; fmt++) {
+            width = width * 10 + (*fmt - '0');
+        }
+
+        if (*fmt == 'u') {
+            unsig = 1;
+            fmt++;
+        }
+
+        if (*fmt == '*') {
+            slen = va_arg(args, size_t);
+            fmt++;
+        }
+
+        p = (u_char *) tmp;
+
+        switch (*fmt) {
+
+        case 'V':
+            v = va_arg(args, ngx_str_t *);
+            p = v->data;
+            len = v->len;
+            break;
+
+        case 's':
+            p = va_arg(args, u_char *);
+            len = (slen == (size_t) -1) ? ngx_strlen(p) : slen;
+            break;
+
+        case 'd':
+            n = unsig ? snprintf(tmp, sizeof(tmp), "%u",
+                                 va_arg(args, unsigned int))
+                      : snprintf(tmp, sizeof(tmp), "%d", va_arg(args, int));
+            len = n;
+            break;
+
+        case 'i':
+        case 'z':
+        case 'O':
+        case 'T':
+        case 'M':
+        case 'L':
+            n = unsig ? snprintf(tmp, sizeof(tmp), "%ju",
+                                 (uintmax_t) va_arg(args, ngx_uint_t))
+                      : snprintf(tmp, sizeof(tmp), "%jd",
+                                 (intmax_t) va_arg(args, ngx_int_t));
+            len = n;
+            break;
+
+        case 'c':
+            tmp[0] = (char) va_arg(args, int);
+            len = 1;
+            break;
+
+        case 'p':
+            n = snprintf(tmp, sizeof(tmp), "%p", va_arg(args, void *));
+            len = n;
+            break;
+
+        case 'Z':
+            tmp[0] = '\0';
+            len = 1;
+            break;
+
+        case 'N':
+            tmp[0] = '\n';
+            len = 1;
+            break;
+
+        default:
+            tmp[0] = *fmt;
+            len = 1;
+            break;
+        }
+
+        fmt++;
+
+        while (width > len && buf < last) {
+            *buf++ = zero ? '0' : ' ';
+            width--;
+        }
+
+        len = ngx_min(len, (size_t) (last - buf));
+        buf = ngx_cpymem(buf, p, len);
+    }
+
+    return buf;
+}
+
+
+u_char *
+ngx_sprintf(u_char *buf, const char *fmt, ...)
+{
+    u_char   *p;
+    va_list   args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, (void *) -1, fmt, args);
+    va_end(args);
+
+    return p;
+}
+
+
+u_char *
+ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...)
+{
+    u_char   *p;
+    va_list   args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, buf + max, fmt, args);
+    va_end(args);
+
+    return p;
+}
+
+
+u_char *
+ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...)
+{
+    u_char   *p;
+    va_list   args;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, last, fmt, args);
+    va_end(args);
+
+    return p;
+}
+
+
+static void
+ngx_stub_log(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+{
+    u_char  *p, errstr[2048];
+
+    if (log && level > log->log_level) {
+        return;
+    }
+
+    p = ngx_vslprintf(errstr, errstr + sizeof(errstr) - 1, fmt, args);
+
+    if (err) {
+        p = ngx_slprintf(p, errstr + sizeof(errstr) - 1, " (%d: %s)",
+                         err, strerror(err));
+    }
+
+    *p++ = '\n';
+
+    (void) fwrite(errstr, 1, p - errstr, stderr);
+}
+
+
+void
+ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+    va_list  args;
+
+    va_start(args, fmt);
+    ngx_stub_log(level, log, err, fmt, args);
+    va_end(args);
+}
+
+
+void
+ngx_log_debug_core(ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+    va_list  args;
+
+    va_start(args, fmt);
+    ngx_stub_log(NGX_LOG_DEBUG, log, err, fmt, args);
+    va_end(args);
+}
+
+
+void
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+    const char *fmt, ...)
+{
+    u_char   *p, *last, buf[2048];
+    va_list   args;
+
+    last = buf + sizeof(buf) - 1;
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(buf, last, fmt, args);
+    va_end(args);
+
+    if (cf->conf_file && cf->conf_file->file.name.data) {
+        p = ngx_slprintf(p, last, " in %V:%ui", &cf->conf_file->file.name,
+                         cf->conf_file->line);
+    }
+
+    if (cf->log && level > cf->log->log_level) {
+        return;
+    }
+
+    *p++ = '\n';
+
+    (void) fwrite(buf, 1, p - buf, stderr);
+}
+
+
+ssize_t
+ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset)
+{
+    ssize_t  n;
+
+    n = pread(file->fd, buf, size, offset);
+
+    if (n == -1) {
+        return NGX_ERROR;
+    }
+
+    file->offset += n;
+
+    return n;
+}
+
+
+ngx_int_t
+ngx_open_glob(ngx_glob_t *gl)
+{
+    gl->n = 0;
+    ngx_memzero(&gl->pglob, sizeof(glob_t));
+
+    return glob((char *) gl->pattern, 0, NULL, &gl->pglob) == 0
+           || gl->test ? NGX_OK : NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_read_glob(ngx_glob_t *gl, ngx_str_t *name)
+{
+    if (gl->n < (size_t) gl->pglob.gl_pathc) {
+        name->data = (u_char *) gl->pglob.gl_pathv[gl->n];
+        name->len = strlen(gl->pglob.gl_pathv[gl->n]);
+        gl->n++;
+
+        return NGX_OK;
+    }
+
+    return NGX_DONE;
+}
+
+
+void
+ngx_close_glob(ngx_glob_t *gl)
+{
+    globfree(&gl->pglob);
+}
+
+
+ngx_int_t
+ngx_conf_full_name(ngx_cycle_t *cycle, ngx_str_t *name,
+    ngx_uint_t conf_prefix)
+{
+    u_char     *p;
+    ngx_str_t  *prefix;
+
+    prefix = conf_prefix ? &cycle->conf_prefix : &cycle->prefix;
+
+    if (prefix->len == 0 || (name->len && name->data[0] == '/')) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(cycle->pool, prefix->len + name->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, prefix->data, prefix->len);
+    ngx_cpystrn(p + prefix->len, name->data, name->len + 1);
+
+    name->data = p;
+    name->len += prefix->len;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_md5_init(ngx_md5_t *ctx)
+{
+    ctx->a = 0xcbf29ce484222325ULL;
+    ctx->b = 0x84222325cbf29ce4ULL;
+}
+
+
+void
+ngx_md5_update(ngx_md5_t *ctx, const void *data, size_t size)
+{
+    const u_char  *p = data;
+
+    while (size--) {
+        ctx->a = (ctx->a ^ *p) * 0x100000001b3ULL;
+        ctx->b = (ctx->b ^ *p++) * 0x100000001b3ULL + 1;
+    }
+}
+
+
+void
+ngx_md5_final(u_char result[16], ngx_md5_t *ctx)
+{
+    ngx_memcpy(result, &ctx->a, 8);
+    ngx_memcpy(result + 8, &ctx->b, 8);
+}